@@ -0,0 +1,696 @@
+// Multi-client load generator for a mounted fisopfs.
+//
+// Mounts a fresh image in a temporary directory, runs every selected
+// workload mix with an increasing number of worker threads going through the
+// real FUSE path, and reports throughput and tail latency for each run.
+// When a baseline file is given, the run fails if any result is worse than the
+// stored one by more than the tolerance, or if the baseline is missing or has
+// no entry for a result.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// The working set must fit the filesystem geometry (64 inodes, 256 blocks of
+// data, 4096 bytes per file), so every worker owns a small directory.
+#define MAX_WORKERS 8
+#define FILES_PER_WORKER 2
+#define FILE_SIZE 1024
+#define IO_SIZE 64
+#define MOUNT_TIMEOUT_MS 10000
+#define MAX_RUNS 64
+#define MAX_BASELINE 128
+
+enum mix { MIX_CREATE, MIX_STAT, MIX_SEQRW, MIX_RANDRW, N_MIXES };
+
+static const char *mix_names[N_MIXES] = { "create", "stat", "seqrw", "randrw" };
+
+struct worker {
+	pthread_t thread;
+	int id;
+	enum mix mix;
+	char dir[PATH_MAX];
+	unsigned int seed;
+	uint64_t *lat;  // latency of each op, in nanoseconds
+	size_t n_lat;
+	size_t cap_lat;
+	int errors;
+};
+
+struct result {
+	enum mix mix;
+	int workers;
+	size_t ops;
+	double ops_per_sec;
+	double p50_us;
+	double p99_us;
+	double p999_us;
+	double max_us;
+	int errors;
+};
+
+struct baseline {
+	char mix[16];
+	int workers;
+	double ops_per_sec;
+	double p99_us;
+};
+
+static char fs_bin[PATH_MAX] = "./fisopfs";
+static char tmp_dir[64];
+static char mount_dir[128];
+static pid_t fs_pid = -1;
+static volatile int running;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+record(struct worker *w, uint64_t start)
+{
+	if (w->n_lat == w->cap_lat) {
+		w->cap_lat = w->cap_lat ? w->cap_lat * 2 : 4096;
+		w->lat = realloc(w->lat, w->cap_lat * sizeof(uint64_t));
+		if (!w->lat) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	w->lat[w->n_lat++] = now_ns() - start;
+}
+
+// Small-file create storm: create, write and remove files in a loop
+static void
+op_create(struct worker *w, int iter)
+{
+	char path[PATH_MAX + 16];
+	char data[IO_SIZE];
+	memset(data, 'c', sizeof(data));
+	snprintf(path, sizeof(path), "%s/c%d", w->dir, iter % FILES_PER_WORKER);
+
+	uint64_t start = now_ns();
+	int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, data, sizeof(data)) != sizeof(data))
+		w->errors++;
+	if (fd >= 0)
+		close(fd);
+	if (unlink(path) < 0)
+		w->errors++;
+	record(w, start);
+}
+
+// ls -l style flood: list the directory and stat every entry
+static void
+op_stat(struct worker *w, int iter)
+{
+	char path[PATH_MAX + 256];
+	struct stat st;
+
+	uint64_t start = now_ns();
+	DIR *dir = opendir(w->dir);
+	if (!dir) {
+		w->errors++;
+		return;
+	}
+	record(w, start);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", w->dir, entry->d_name);
+		start = now_ns();
+		if (lstat(path, &st) < 0)
+			w->errors++;
+		record(w, start);
+	}
+	closedir(dir);
+}
+
+// Sequential rewrite of a whole file followed by a sequential read of it
+static void
+op_seqrw(struct worker *w, int iter)
+{
+	char path[PATH_MAX + 16];
+	char data[IO_SIZE];
+	memset(data, 's', sizeof(data));
+	snprintf(path, sizeof(path), "%s/s%d", w->dir, iter % FILES_PER_WORKER);
+
+	int fd = open(path, O_RDWR | O_TRUNC);
+	if (fd < 0) {
+		w->errors++;
+		return;
+	}
+
+	for (off_t off = 0; off < FILE_SIZE; off += IO_SIZE) {
+		uint64_t start = now_ns();
+		if (pwrite(fd, data, IO_SIZE, off) != IO_SIZE)
+			w->errors++;
+		record(w, start);
+	}
+	for (off_t off = 0; off < FILE_SIZE; off += IO_SIZE) {
+		uint64_t start = now_ns();
+		if (pread(fd, data, IO_SIZE, off) < 0)
+			w->errors++;
+		record(w, start);
+	}
+	close(fd);
+}
+
+// Random reads and writes inside an existing file, half and half
+static void
+op_randrw(struct worker *w, int iter)
+{
+	char path[PATH_MAX + 16];
+	char data[IO_SIZE];
+	memset(data, 'r', sizeof(data));
+	snprintf(path, sizeof(path), "%s/s%d", w->dir, iter % FILES_PER_WORKER);
+
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		w->errors++;
+		return;
+	}
+
+	for (int i = 0; i < FILE_SIZE / IO_SIZE; i++) {
+		off_t off = (rand_r(&w->seed) % (FILE_SIZE / IO_SIZE)) * IO_SIZE;
+		uint64_t start = now_ns();
+		ssize_t n = (rand_r(&w->seed) & 1) ? pwrite(fd, data, IO_SIZE, off)
+		                                   : pread(fd, data, IO_SIZE, off);
+		if (n < 0)
+			w->errors++;
+		record(w, start);
+	}
+	close(fd);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	for (int iter = 0; running; iter++) {
+		switch (w->mix) {
+		case MIX_CREATE:
+			op_create(w, iter);
+			break;
+		case MIX_STAT:
+			op_stat(w, iter);
+			break;
+		case MIX_SEQRW:
+			op_seqrw(w, iter);
+			break;
+		case MIX_RANDRW:
+			op_randrw(w, iter);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile_us(uint64_t *lat, size_t n, double p)
+{
+	if (n == 0)
+		return 0;
+	size_t i = (size_t) (p * (n - 1));
+	return lat[i] / 1000.0;
+}
+
+static int
+prepare_workers(int n_workers)
+{
+	char path[PATH_MAX + 32];
+	char data[FILE_SIZE];
+	memset(data, 'p', sizeof(data));
+
+	for (int i = 0; i < n_workers; i++) {
+		snprintf(path, sizeof(path), "%s/w%d", mount_dir, i);
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		for (int f = 0; f < FILES_PER_WORKER; f++) {
+			snprintf(path, sizeof(path), "%s/w%d/s%d", mount_dir, i, f);
+			int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+			if (fd < 0 || write(fd, data, sizeof(data)) != sizeof(data)) {
+				fprintf(stderr,
+				        "populate %s: %s\n",
+				        path,
+				        strerror(errno));
+				if (fd >= 0)
+					close(fd);
+				return -1;
+			}
+			close(fd);
+		}
+	}
+
+	return 0;
+}
+
+static int
+run(enum mix mix, int n_workers, int duration_ms, struct result *res)
+{
+	struct worker workers[MAX_WORKERS];
+	memset(workers, 0, sizeof(workers));
+
+	running = 1;
+	for (int i = 0; i < n_workers; i++) {
+		struct worker *w = &workers[i];
+		w->id = i;
+		w->mix = mix;
+		w->seed = 1234 + i;
+		snprintf(w->dir, sizeof(w->dir), "%s/w%d", mount_dir, i);
+	}
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < n_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) !=
+		    0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	struct timespec ts = { duration_ms / 1000, (duration_ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+	running = 0;
+
+	for (int i = 0; i < n_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	double elapsed = (now_ns() - start) / 1e9;
+
+	size_t total = 0;
+	for (int i = 0; i < n_workers; i++)
+		total += workers[i].n_lat;
+
+	uint64_t *lat = malloc((total ? total : 1) * sizeof(uint64_t));
+	size_t n = 0;
+	memset(res, 0, sizeof(*res));
+	for (int i = 0; i < n_workers; i++) {
+		memcpy(lat + n, workers[i].lat, workers[i].n_lat * sizeof(uint64_t));
+		n += workers[i].n_lat;
+		res->errors += workers[i].errors;
+		free(workers[i].lat);
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+	res->mix = mix;
+	res->workers = n_workers;
+	res->ops = n;
+	res->ops_per_sec = n / elapsed;
+	res->p50_us = percentile_us(lat, n, 0.50);
+	res->p99_us = percentile_us(lat, n, 0.99);
+	res->p999_us = percentile_us(lat, n, 0.999);
+	res->max_us = n ? lat[n - 1] / 1000.0 : 0;
+	free(lat);
+
+	return res->errors ? -1 : 0;
+}
+
+static int
+is_mounted(void)
+{
+	struct stat mnt, parent;
+	if (stat(mount_dir, &mnt) < 0 || stat(tmp_dir, &parent) < 0)
+		return 0;
+	return mnt.st_dev != parent.st_dev;
+}
+
+static int
+mount_fs(void)
+{
+	char options[sizeof(tmp_dir) + 64];
+
+	// A fresh temporary directory gives a fresh image. Only errors are
+	// logged, so the benchmark doesn't measure the debug output
+	snprintf(options,
+	         sizeof(options),
+	         "image=%s/file_system.fisopfs,log=error",
+	         tmp_dir);
+
+	fs_pid = fork();
+	if (fs_pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (fs_pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		execl(fs_bin, fs_bin, "-f", "-o", options, mount_dir, (char *) NULL);
+		_exit(127);
+	}
+
+	for (int waited = 0; waited < MOUNT_TIMEOUT_MS; waited += 10) {
+		if (is_mounted())
+			return 0;
+		int status;  // fisopfs exits with the errno of a bad configuration
+
+		if (waitpid(fs_pid, &status, WNOHANG) == fs_pid) {
+			fprintf(stderr,
+			        "%s exited before mounting: %s\n",
+			        fs_bin,
+			        WIFEXITED(status) ? strerror(WEXITSTATUS(status))
+			                          : "killed");
+			fs_pid = -1;
+			return -1;
+		}
+		usleep(10000);
+	}
+
+	fprintf(stderr, "timed out waiting for %s to mount\n", mount_dir);
+	return -1;
+}
+
+static void
+cleanup(void)
+{
+	char path[PATH_MAX + 32];
+
+	if (fs_pid > 0) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			execlp("fusermount3", "fusermount3", "-u", mount_dir, (char *) NULL);
+			_exit(127);
+		}
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		if (waitpid(fs_pid, NULL, 0) < 0)
+			kill(fs_pid, SIGTERM);
+		fs_pid = -1;
+	}
+
+	if (tmp_dir[0]) {
+		rmdir(mount_dir);
+		snprintf(path, sizeof(path), "%s/file_system.fisopfs", tmp_dir);
+		unlink(path);
+		rmdir(tmp_dir);
+		tmp_dir[0] = '\0';
+	}
+}
+
+static int
+load_baseline(const char *file, struct baseline *base)
+{
+	FILE *f = fopen(file, "r");
+	char line[256];
+	int n = 0;
+
+	if (!f)
+		return -1;
+
+	while (n < MAX_BASELINE && fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line,
+		           "%15s %d %lf %lf",
+		           base[n].mix,
+		           &base[n].workers,
+		           &base[n].ops_per_sec,
+		           &base[n].p99_us) == 4)
+			n++;
+	}
+
+	fclose(f);
+	return n;
+}
+
+static int
+save_baseline(const char *file, struct result *res, int n_res)
+{
+	FILE *f = fopen(file, "w");
+
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, "# mix workers ops_per_sec p99_us\n");
+	for (int i = 0; i < n_res; i++)
+		fprintf(f,
+		        "%s %d %.0f %.1f\n",
+		        mix_names[res[i].mix],
+		        res[i].workers,
+		        res[i].ops_per_sec,
+		        res[i].p99_us);
+
+	fclose(f);
+	return 0;
+}
+
+// compare(res, base, tolerance);
+// return: number of results worse than their baseline entry or without one
+
+static int
+compare(struct result *res, int n_res, struct baseline *base, int n_base, double tolerance)
+{
+	int failed = 0;
+
+	for (int i = 0; i < n_res; i++) {
+		int found = 0;
+
+		for (int j = 0; j < n_base; j++) {
+			if (strcmp(base[j].mix, mix_names[res[i].mix]) != 0 ||
+			    base[j].workers != res[i].workers)
+				continue;
+
+			found = 1;
+			if (res[i].ops_per_sec < base[j].ops_per_sec * (1 - tolerance)) {
+				printf("REGRESSION %s/%d: %.0f ops/s, baseline "
+				       "%.0f\n",
+				       base[j].mix,
+				       base[j].workers,
+				       res[i].ops_per_sec,
+				       base[j].ops_per_sec);
+				failed++;
+			}
+			if (res[i].p99_us > base[j].p99_us * (1 + tolerance)) {
+				printf("REGRESSION %s/%d: p99 %.1f us, baseline "
+				       "%.1f\n",
+				       base[j].mix,
+				       base[j].workers,
+				       res[i].p99_us,
+				       base[j].p99_us);
+				failed++;
+			}
+		}
+
+		if (!found) {
+			printf("REGRESSION %s/%d: not in the baseline\n",
+			       mix_names[res[i].mix],
+			       res[i].workers);
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-f fisopfs] [-w 1,2,4,8] [-m create,stat,seqrw,randrw]\n"
+	        "          [-d duration_ms] [-b baseline] [-s] [-t tolerance]\n"
+	        "  -f  filesystem binary to mount (default ./fisopfs)\n"
+	        "  -w  worker counts to run, at most %d\n"
+	        "  -m  workload mixes to run\n"
+	        "  -d  duration of each run in milliseconds (default 2000)\n"
+	        "  -b  baseline file to compare against (or to save with -s)\n"
+	        "  -s  save the results as the new baseline\n"
+	        "  -t  allowed regression, as a fraction (default 0.2)\n",
+	        prog,
+	        MAX_WORKERS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int worker_counts[MAX_WORKERS] = { 1, 2, 4, 8 };
+	int n_counts = 4;
+	int mixes[N_MIXES] = { 1, 1, 1, 1 };
+	int duration_ms = 2000;
+	const char *baseline_file = NULL;
+	int save = 0;
+	double tolerance = 0.2;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:w:m:d:b:st:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!realpath(optarg, fs_bin)) {
+				fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'w':
+			n_counts = 0;
+			for (char *tok = strtok(optarg, ","); tok && n_counts < MAX_WORKERS;
+			     tok = strtok(NULL, ",")) {
+				int n = atoi(tok);
+				if (n < 1 || n > MAX_WORKERS) {
+					usage(argv[0]);
+					return 1;
+				}
+				worker_counts[n_counts++] = n;
+			}
+			break;
+		case 'm':
+			memset(mixes, 0, sizeof(mixes));
+			for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+				int found = 0;
+				for (int m = 0; m < N_MIXES; m++) {
+					if (strcmp(tok, mix_names[m]) == 0) {
+						mixes[m] = found = 1;
+					}
+				}
+				if (!found) {
+					usage(argv[0]);
+					return 1;
+				}
+			}
+			break;
+		case 'd':
+			duration_ms = atoi(optarg);
+			break;
+		case 'b':
+			baseline_file = optarg;
+			break;
+		case 's':
+			save = 1;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	struct baseline base[MAX_BASELINE];
+	int n_base = 0;
+
+	if (baseline_file && !save) {  // Fail closed, before the runs
+		n_base = load_baseline(baseline_file, base);
+		if (n_base <= 0) {
+			fprintf(stderr,
+			        "%s: %s, create it with -s (make loadgen-baseline)\n",
+			        baseline_file,
+			        n_base < 0 ? strerror(errno) : "no entries");
+			return 1;
+		}
+	}
+
+	if (fs_bin[0] != '/' && !realpath("./fisopfs", fs_bin)) {
+		fprintf(stderr, "./fisopfs: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snprintf(tmp_dir, sizeof(tmp_dir), "/tmp/fisopfs-loadgen.XXXXXX");
+	if (!mkdtemp(tmp_dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(mount_dir, sizeof(mount_dir), "%s/mnt", tmp_dir);
+	if (mkdir(mount_dir, 0755) < 0) {
+		perror("mkdir");
+		return 1;
+	}
+	atexit(cleanup);
+
+	if (mount_fs() < 0)
+		return 1;
+
+	int max_workers = 1;
+	for (int i = 0; i < n_counts; i++)
+		if (worker_counts[i] > max_workers)
+			max_workers = worker_counts[i];
+	if (prepare_workers(max_workers) < 0)
+		return 1;
+
+	struct result results[MAX_RUNS];
+	int n_res = 0;
+	int errors = 0;
+
+	printf("%-8s %7s %9s %11s %8s %9s %9s %10s %9s\n",
+	       "mix",
+	       "workers",
+	       "ops",
+	       "ops/s",
+	       "speedup",
+	       "p50(us)",
+	       "p99(us)",
+	       "p99.9(us)",
+	       "max(us)");
+
+	for (int m = 0; m < N_MIXES; m++) {
+		if (!mixes[m])
+			continue;
+
+		double single = 0;
+		for (int i = 0; i < n_counts && n_res < MAX_RUNS; i++) {
+			struct result *res = &results[n_res++];
+			if (run(m, worker_counts[i], duration_ms, res) < 0)
+				errors += res->errors;
+			if (i == 0)
+				single = res->ops_per_sec / res->workers;
+
+			printf("%-8s %7d %9zu %11.0f %7.2fx %9.1f %9.1f %10.1f "
+			       "%9.1f\n",
+			       mix_names[m],
+			       res->workers,
+			       res->ops,
+			       res->ops_per_sec,
+			       single > 0 ? res->ops_per_sec / single : 0,
+			       res->p50_us,
+			       res->p99_us,
+			       res->p999_us,
+			       res->max_us);
+		}
+	}
+
+	if (errors)
+		printf("%d operations failed\n", errors);
+
+	if (baseline_file && save)
+		return save_baseline(baseline_file, results, n_res) < 0 || errors;
+
+	if (baseline_file && compare(results, n_res, base, n_base, tolerance) > 0)
+		return 1;
+
+	return errors ? 1 : 0;
+}
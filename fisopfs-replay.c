@@ -0,0 +1,533 @@
+// Replays a trace captured with the trace= mount option of fisopfs against
+// the filesystem core, without FUSE or the kernel in between, and reports
+// the throughput and the latency of each kind of operation.
+//
+// The operations run in the order they were captured, in a single thread,
+// as fast as possible or, with -r, at the times they were captured. They
+// start from the given image, which is never written (nopersist), or from
+// an empty filesystem. With cache_blocks, evicted blocks need an image to go
+// to, so the replay runs on a scratch copy instead. Written data is not in
+// the trace, so writes use filler bytes, and utimens sets the times to now.
+
+#define FISOPFS_NO_MAIN
+#include "fisopfs.c"
+#include <threads.h>
+
+#define MAX_HANDLES 1024  // files open at once in the trace
+
+static const char *op_names[TRACE_N_OPS] = {
+	[TRACE_GETATTR] = "getattr",   [TRACE_READDIR] = "readdir",
+	[TRACE_MKNOD] = "mknod",       [TRACE_CREATE] = "create",
+	[TRACE_OPEN] = "open",         [TRACE_READ] = "read",
+	[TRACE_WRITE] = "write",       [TRACE_FLUSH] = "flush",
+	[TRACE_FSYNC] = "fsync",       [TRACE_RELEASE] = "release",
+	[TRACE_UNLINK] = "unlink",     [TRACE_MKDIR] = "mkdir",
+	[TRACE_RMDIR] = "rmdir",       [TRACE_UTIMENS] = "utimens",
+	[TRACE_GETXATTR] = "getxattr", [TRACE_SETXATTR] = "setxattr",
+	[TRACE_CHMOD] = "chmod",       [TRACE_CHOWN] = "chown",
+	[TRACE_TRUNCATE] = "truncate", [TRACE_FALLOCATE] = "fallocate",
+	[TRACE_COPY_FILE_RANGE] = "copy", [TRACE_CLONE] = "clone",
+};
+
+// Latencies of each kind of operation, replayed and as captured
+
+struct op_stats {
+	long n;
+	long cap;
+	long mismatches;  // replayed result differs from the captured one
+	long long *replayed;
+	long long *captured;
+};
+
+static struct op_stats stats[TRACE_N_OPS];
+
+// The handles fisopfs set on open are recorded, so the operations on an open
+// file get the fuse_file_info its replayed open filled
+
+static struct handle {
+	unsigned long long fh;  // as captured, 0 if the slot is free
+	struct fuse_file_info fi;
+} handles[MAX_HANDLES];
+
+static struct fuse_file_info *
+find_handle(unsigned long long fh)
+{
+	for (int i = 0; fh && i < MAX_HANDLES; i++)
+		if (handles[i].fh == fh)
+			return &handles[i].fi;
+
+	return NULL;
+}
+
+static void
+add_handle(unsigned long long fh, struct fuse_file_info *fi)
+{
+	for (int i = 0; fh && i < MAX_HANDLES; i++) {
+		if (handles[i].fh == 0) {
+			handles[i].fh = fh;
+			handles[i].fi = *fi;
+			return;
+		}
+	}
+}
+
+static void
+drop_handle(unsigned long long fh)
+{
+	for (int i = 0; fh && i < MAX_HANDLES; i++)
+		if (handles[i].fh == fh)
+			handles[i].fh = 0;
+}
+
+static int
+add_sample(int op, long long replayed, long long captured)
+{
+	struct op_stats *st = &stats[op];
+
+	if (st->n == st->cap) {
+		long cap = st->cap ? st->cap * 2 : 1024;
+		long long *r = realloc(st->replayed, cap * sizeof(long long));
+		long long *c = r ? realloc(st->captured, cap * sizeof(long long))
+		                 : NULL;
+
+		if (r)
+			st->replayed = r;
+		if (c)
+			st->captured = c;
+		if (!r || !c)
+			return -1;
+		st->cap = cap;
+	}
+
+	st->replayed[st->n] = replayed;
+	st->captured[st->n] = captured;
+	st->n++;
+
+	return 0;
+}
+
+static int
+fill_nothing(void *buf,
+             const char *name,
+             const struct stat *st,
+             off_t off,
+             enum fuse_fill_dir_flags flags)
+{
+	return 0;
+}
+
+// replay_op(rec, path, arg, data);
+// recv: data with room for rec->size bytes
+// return: what the core returned
+
+static int
+replay_op(struct trace_record *rec, const char *path, const char *arg, char *data)
+{
+	struct fuse_file_info none = { 0 };
+	struct fuse_file_info *fi = find_handle(rec->fh);
+	struct fisopfs_clone clone;
+	struct stat st;
+	int ret;
+
+	if (!fi)
+		fi = &none;
+
+	switch (rec->op) {
+	case TRACE_GETATTR:
+		return operations.getattr(path, &st, NULL);
+	case TRACE_READDIR:
+		return operations.readdir(
+		        path, NULL, fill_nothing, rec->offset, fi, rec->flags);
+	case TRACE_MKNOD:
+		return operations.mknod(path, rec->flags, 0);
+	case TRACE_CREATE:
+		ret = operations.create(path, rec->flags, &none);
+		add_handle(rec->fh, &none);
+		return ret;
+	case TRACE_OPEN:
+		none.flags = rec->flags;
+		ret = operations.open(path, &none);
+		add_handle(rec->fh, &none);
+		return ret;
+	case TRACE_READ:
+		return operations.read(path, data, rec->size, rec->offset, fi);
+	case TRACE_WRITE:
+		return operations.write(path, data, rec->size, rec->offset, fi);
+	case TRACE_FLUSH:
+		return operations.flush(path, fi);
+	case TRACE_FSYNC:
+		return operations.fsync(path, rec->flags, fi);
+	case TRACE_RELEASE:
+		ret = operations.release(path, fi);
+		drop_handle(rec->fh);
+		return ret;
+	case TRACE_UNLINK:
+		return operations.unlink(path);
+	case TRACE_MKDIR:
+		return operations.mkdir(path, rec->flags);
+	case TRACE_RMDIR:
+		return operations.rmdir(path);
+	case TRACE_UTIMENS:
+		return operations.utimens(path, NULL, fi);
+	case TRACE_GETXATTR:
+		return operations.getxattr(path, arg, data, rec->size);
+	case TRACE_SETXATTR:
+		return operations.setxattr(path, arg, data, rec->size, rec->flags);
+	case TRACE_CHMOD:
+		return operations.chmod(path, rec->flags, fi);
+	case TRACE_CHOWN:
+		return operations.chown(path, rec->flags, rec->size, fi);
+	case TRACE_TRUNCATE:
+		return operations.truncate(path, rec->offset, fi);
+	case TRACE_FALLOCATE:
+		return operations.fallocate(
+		        path, rec->flags, rec->offset, rec->size, fi);
+	case TRACE_COPY_FILE_RANGE:
+		return operations.copy_file_range(
+		        path, &none, rec->offset, arg, fi, rec->flags, rec->size, 0);
+	case TRACE_CLONE:
+		if (rec->arg_len >= sizeof(clone.src))  // Never captured
+			return -EINVAL;
+		memcpy(clone.src, arg, rec->arg_len + 1);
+		return operations.ioctl(path, FISOPFS_IOC_CLONE, NULL, fi, 0, &clone);
+	default:
+		return -ENOSYS;
+	}
+}
+
+static int
+compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+// percentile(v, n, p);
+// recv: v sorted
+// return: the p-th percentile, in microseconds
+
+static double
+percentile(long long *v, long n, double p)
+{
+	long i = (long) (p / 100 * (n - 1) + 0.5);
+
+	return n ? v[i] / 1000.0 : 0;
+}
+
+static void
+report(long long elapsed, long skipped)
+{
+	long total = 0, mismatches = 0;
+
+	printf("%-10s %8s %9s %9s %9s %9s %11s %11s\n",
+	       "op",
+	       "count",
+	       "mismatch",
+	       "p50_us",
+	       "p99_us",
+	       "max_us",
+	       "cap_p50_us",
+	       "cap_p99_us");
+
+	for (int op = 0; op < TRACE_N_OPS; op++) {
+		struct op_stats *st = &stats[op];
+
+		if (!st->n)
+			continue;
+
+		qsort(st->replayed, st->n, sizeof(long long), compare_ll);
+		qsort(st->captured, st->n, sizeof(long long), compare_ll);
+		printf("%-10s %8ld %9ld %9.1f %9.1f %9.1f %11.1f %11.1f\n",
+		       op_names[op],
+		       st->n,
+		       st->mismatches,
+		       percentile(st->replayed, st->n, 50),
+		       percentile(st->replayed, st->n, 99),
+		       percentile(st->replayed, st->n, 100),
+		       percentile(st->captured, st->n, 50),
+		       percentile(st->captured, st->n, 99));
+		total += st->n;
+		mismatches += st->mismatches;
+	}
+
+	printf("%ld operations in %.3f s, %.0f ops/s, %ld with a different "
+	       "result than captured",
+	       total,
+	       elapsed / 1e9,
+	       elapsed ? total / (elapsed / 1e9) : 0,
+	       mismatches);
+	if (skipped)
+		printf(", %ld skipped", skipped);
+	printf("\n");
+}
+
+// replay(file, timed);
+// return: 0, or -1 if the trace is not valid
+
+static int
+replay(FILE *file, int timed)
+{
+	struct trace_record rec;
+	char path[TRACE_MAX_LEN + 1];
+	char arg[TRACE_MAX_LEN + 1];
+	char *data = NULL;
+	size_t data_size = 0;
+	long skipped = 0;
+	int ret = 0;
+	long long begin = trace_now();
+
+	while (fread(&rec, sizeof(struct trace_record), 1, file) == 1) {
+		if (rec.path_len + rec.arg_len > TRACE_MAX_LEN ||
+		    fread(path, 1, rec.path_len, file) != rec.path_len ||
+		    fread(arg, 1, rec.arg_len, file) != rec.arg_len) {
+			fprintf(stderr, "truncated trace\n");
+			ret = -1;
+			break;
+		}
+		path[rec.path_len] = '\0';
+		arg[rec.arg_len] = '\0';
+
+		if (rec.path_len == 0 || rec.op <= 0 || rec.op >= TRACE_N_OPS) {
+			skipped++;  // The path was too long to be captured
+			continue;
+		}
+
+		if (rec.size > data_size) {
+			char *grown = realloc(data, rec.size);
+
+			if (!grown) {
+				ret = -1;
+				break;
+			}
+			memset(grown + data_size, 'x', rec.size - data_size);
+			data = grown;
+			data_size = rec.size;
+		}
+
+		if (timed) {  // Wait for the time the operation was captured at
+			long long wait = rec.start - (trace_now() - begin);
+
+			if (wait > 0)
+				thrd_sleep(&(struct timespec){ .tv_sec = wait / 1000000000,
+				                               .tv_nsec = wait % 1000000000 },
+				           NULL);
+		}
+
+		long long start = trace_now();
+		int result = replay_op(&rec, path, arg, data);
+		long long latency = trace_now() - start;
+
+		if (result != rec.result)
+			stats[rec.op].mismatches++;
+		if (add_sample(rec.op, latency, rec.latency) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	report(trace_now() - begin, skipped);
+	free(data);
+
+	return ret;
+}
+
+// copy_file(from, to);
+// return: 0, or an errno after reporting it
+
+static int
+copy_file(const char *from, const char *to)
+{
+	FILE *in = fopen(from, "rb");
+	FILE *out = in ? fopen(to, "wb") : NULL;
+	char buf[64 * 1024];
+	size_t n;
+	int err = 0;
+
+	if (!out) {
+		err = errno;
+		fprintf(stderr, "%s: %s\n", in ? to : from, strerror(err));
+		if (in)
+			fclose(in);
+		return err;
+	}
+
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		if (fwrite(buf, 1, n, out) != n)
+			break;
+
+	if (ferror(in) || ferror(out))
+		err = errno ? errno : EIO;
+	fclose(in);
+	if (fclose(out) != 0 && !err)
+		err = errno;
+	if (err)
+		fprintf(stderr, "%s: %s\n", to, strerror(err));
+
+	return err;
+}
+
+// scratch_image(image, base);
+// Points file_name at base.replay, a copy of image and its shards, or a new
+// image if there is none, which the block cache can write back to
+// return: 0, or an errno after reporting it
+
+static int scratch_shards;  // Files of the scratch image, removed at the end
+
+static int
+scratch_image(const char *image, const char *base)
+{
+	char from[MAX_FILE_NAME_SIZE + 12];
+	char to[MAX_FILE_NAME_SIZE + 12];
+	struct superblock disk = { .n_shards = n_shards };
+	FILE *file;
+
+	if (strlen(base) + strlen(".replay") >= MAX_FILE_NAME_SIZE) {
+		fprintf(stderr, "%s: %s\n", base, strerror(ENAMETOOLONG));
+		return ENAMETOOLONG;
+	}
+
+	if (image && (file = fopen(image, "rb"))) {
+		if (fread(&disk, sizeof(disk), 1, file) != 1)
+			disk.n_shards = 1;
+		fclose(file);
+	}
+	if (disk.n_shards < 1 || disk.n_shards > MAX_SHARDS)
+		disk.n_shards = 1;  // check_image reports a bad image
+
+	snprintf(file_name, MAX_FILE_NAME_SIZE, "%s.replay", base);
+	for (int k = 0; k < disk.n_shards; k++) {
+		shard_path(k, to);
+		if ((file = fopen(to, "rb"))) {  // Never clobber a file of the user
+			fclose(file);
+			fprintf(stderr, "%s: %s\n", to, strerror(EEXIST));
+			return EEXIST;
+		}
+	}
+
+	scratch_shards = disk.n_shards;
+
+	for (int k = 0; image && k < disk.n_shards; k++) {
+		snprintf(file_name, MAX_FILE_NAME_SIZE, "%s", image);
+		shard_path(k, from);
+		snprintf(file_name, MAX_FILE_NAME_SIZE, "%s.replay", base);
+		shard_path(k, to);
+
+		int err = copy_file(from, to);
+		if (err)
+			return err;
+	}
+
+	persist = 1;  // Only the copy is written
+
+	return 0;
+}
+
+static void
+remove_scratch()
+{
+	char path[MAX_FILE_NAME_SIZE + 12];
+
+	for (int k = 0; k < scratch_shards; k++) {
+		shard_path(k, path);
+		remove(path);
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-r] [-o options] trace [image]\n"
+	        "  -r  replay with the original timing, instead of as fast as "
+	        "possible\n"
+	        "  -o  fisopfs mount options, such as cache_blocks=N or "
+	        "log=debug\n"
+	        "  image is loaded but never written, without it the replay "
+	        "starts\n"
+	        "  from an empty filesystem. With cache_blocks both run on a "
+	        "scratch\n"
+	        "  copy at <image or trace>.replay, removed at the end\n",
+	        prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *trace = NULL;
+	const char *image = NULL;
+	const char *options = NULL;
+	int timed = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0) {
+			timed = 1;
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			options = argv[++i];
+		} else if (argv[i][0] == '-' || (trace && image)) {
+			usage(argv[0]);
+			return 2;
+		} else if (!trace) {
+			trace = argv[i];
+		} else {
+			image = argv[i];
+		}
+	}
+
+	if (!trace) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	log_level = LOG_ERROR;  // Logging would dominate the latencies
+	persist = 0;
+	if (image) {
+		snprintf(file_name, MAX_FILE_NAME_SIZE, "%s", image);
+		create = 0;
+	} else {
+		file_name[0] = '\0';  // An empty path never exists: empty filesystem
+	}
+
+	char *opt_argv[] = { argv[0], "-o", (char *) options, NULL };
+	struct fuse_args args = FUSE_ARGS_INIT(options ? 3 : 1, opt_argv);
+
+	if (fuse_opt_parse(&args, NULL, fisopfs_opts, fisopfs_opt_proc) == -1)
+		return EINVAL;
+	fuse_opt_free_args(&args);
+
+	FILE *file = fopen(trace, "rb");
+	int magic = 0;
+
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", trace, strerror(errno));
+		return errno;
+	}
+	if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a fisopfs trace\n", trace);
+		fclose(file);
+		return EINVAL;
+	}
+
+	int err = cache_blocks ? scratch_image(image, image ? image : trace) : 0;
+
+	if (err == 0)
+		err = -check_image();
+	if (err) {
+		remove_scratch();
+		fclose(file);
+		return err;
+	}
+
+	operations.init(NULL, NULL);
+	int ret = replay(file, timed);
+	operations.destroy(NULL);
+	fclose(file);
+	remove_scratch();
+
+	for (int op = 0; op < TRACE_N_OPS; op++) {
+		free(stats[op].replayed);
+		free(stats[op].captured);
+	}
+
+	return ret < 0;
+}
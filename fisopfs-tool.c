@@ -0,0 +1,1217 @@
+// Offline tool for fisopfs images.
+//
+//   mkfs   creates an empty image with the chosen geometry
+//   fsck   cross-checks the bitmaps against the inodes and block chains and
+//          recovers orphans into /lost+found
+//   dump   prints the tables and usage stats
+//   defrag rewrites every block chain as a contiguous run and compacts the
+//          file tables
+//
+// The whole image is loaded in memory using the on-disk structs of fisopfs.h,
+// so it must not be mounted while the tool runs.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "fisopfs.h"
+
+#define LOST_FOUND "lost+found"
+#define PATH_LEN ((MAX_DEPTH_DIR + 1) * (NAME_MAX_LEN + 1) + 2)
+
+struct image {
+	struct superblock sb;
+	struct bmap_inodes bitmap_inodes;
+	struct bmap_blocks bitmap_blocks;
+	struct inode inodes[N_INODES];
+	int block_fill[N_BLOCKS];
+	int block_next[N_BLOCKS];
+	struct file files[N_INODES];
+	struct dirent dirs[N_INODES];
+	struct name_arena names;
+	struct snapshot snapshots[N_SNAPSHOTS];
+	char data[N_BLOCKS][BLOCK_SIZE];
+};
+
+// Sharded images are split into files path, path.1, path.2, ... As fisopfs
+// does, each file holds the superblock and the slices its shard owns (see
+// SHARD_START) at their offsets in a whole image, with holes in between, and
+// only those slices are taken from it when loading.
+
+struct slice {
+	long off;  // in the image
+	const void *data;
+	size_t size;
+};
+
+#define MAX_SLICES 10
+
+static void
+shard_path(const char *path, int k, char buf[FILENAME_MAX])
+{
+	if (k == 0)
+		snprintf(buf, FILENAME_MAX, "%s", path);
+	else
+		snprintf(buf, FILENAME_MAX, "%s.%d", path, k);
+}
+
+static int
+read_image(const char *path, struct image *img)
+{
+	FILE *file = fopen(path, "rb");
+
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	memset(img, 0, sizeof(struct image));
+
+	int ok = fread(&img->sb, sizeof(struct superblock), 1, file) == 1 &&
+	         fread(&img->bitmap_inodes, sizeof(struct bmap_inodes), 1, file) == 1 &&
+	         fread(&img->bitmap_blocks, sizeof(struct bmap_blocks), 1, file) == 1 &&
+	         fread(img->inodes, sizeof(struct inode), N_INODES, file) == N_INODES &&
+	         fread(img->block_fill, sizeof(int), N_BLOCKS, file) == N_BLOCKS &&
+	         fread(img->block_next, sizeof(int), N_BLOCKS, file) == N_BLOCKS &&
+	         fread(img->files, sizeof(struct file), N_INODES, file) == N_INODES &&
+	         fread(img->dirs, sizeof(struct dirent), N_INODES, file) == N_INODES &&
+	         fread(&img->names, sizeof(struct name_arena), 1, file) == 1 &&
+	         fread(img->snapshots, sizeof(struct snapshot), N_SNAPSHOTS, file) ==
+	                 N_SNAPSHOTS &&
+	         fseek(file, DATA_OFFSET, SEEK_SET) == 0;
+
+	if (ok)  // Missing blocks at the end read as zeros
+		fread(img->data, BLOCK_SIZE, N_BLOCKS, file);
+
+	fclose(file);
+
+	if (!ok) {
+		fprintf(stderr, "%s: truncated image\n", path);
+		return -1;
+	}
+
+	if (img->sb.magic != SUPERBLOCK_MAGIC) {
+		fprintf(stderr,
+		        "%s: bad magic %d, not an image of this version\n",
+		        path,
+		        img->sb.magic);
+		return -1;
+	}
+
+	return 0;
+}
+
+// shard_slices(img, k, slices);
+// recv: slices with room for MAX_SLICES
+// return: number of slices kept in the file of shard k
+
+static int
+shard_slices(struct image *img, int k, struct slice *slices)
+{
+	struct superblock *sb = &img->sb;
+	int i0 = SHARD_START(k, sb->n_shards, sb->n_inodes, N_INODES);
+	int i1 = SHARD_START(k + 1, sb->n_shards, sb->n_inodes, N_INODES);
+	int b0 = SHARD_START(k, sb->n_shards, sb->n_blocks, N_BLOCKS);
+	int b1 = SHARD_START(k + 1, sb->n_shards, sb->n_blocks, N_BLOCKS);
+	int n = 0;
+
+	slices[n++] = (struct slice){ OFF_BITMAP_INODES + (long) sizeof(int) * i0,
+		                      &img->bitmap_inodes.free_inodes[i0],
+		                      sizeof(int) * (i1 - i0) };
+	slices[n++] = (struct slice){ OFF_BITMAP_BLOCKS + (long) sizeof(int) * b0,
+		                      &img->bitmap_blocks.free_blocks[b0],
+		                      sizeof(int) * (b1 - b0) };
+	slices[n++] = (struct slice){ OFF_INODES + (long) sizeof(struct inode) * i0,
+		                      &img->inodes[i0],
+		                      sizeof(struct inode) * (i1 - i0) };
+	slices[n++] = (struct slice){ OFF_BLOCK_FILL + (long) sizeof(int) * b0,
+		                      &img->block_fill[b0],
+		                      sizeof(int) * (b1 - b0) };
+	slices[n++] = (struct slice){ OFF_BLOCK_NEXT + (long) sizeof(int) * b0,
+		                      &img->block_next[b0],
+		                      sizeof(int) * (b1 - b0) };
+
+	if (k == 0) {  // The namespace is not split
+		slices[n++] = (struct slice){ OFF_FILES,
+			                      img->files,
+			                      sizeof(struct file) * N_INODES };
+		slices[n++] = (struct slice){ OFF_DIRS,
+			                      img->dirs,
+			                      sizeof(struct dirent) * N_INODES };
+		slices[n++] = (struct slice){ OFF_NAMES,
+			                      &img->names,
+			                      sizeof(struct name_arena) };
+		slices[n++] = (struct slice){ OFF_SNAPSHOTS,
+			                      img->snapshots,
+			                      sizeof(struct snapshot) * N_SNAPSHOTS };
+	}
+
+	slices[n++] = (struct slice){ DATA_OFFSET + (long) BLOCK_SIZE * b0,
+		                      img->data[b0],
+		                      (size_t) BLOCK_SIZE * (b1 - b0) };
+
+	return n;
+}
+
+// take_shard(img, shard, k);
+// Copies the slices shard k owns from the image read from its file
+
+static void
+take_shard(struct image *img, struct image *shard, int k)
+{
+	struct superblock *sb = &img->sb;
+	int i0 = SHARD_START(k, sb->n_shards, sb->n_inodes, N_INODES);
+	int i1 = SHARD_START(k + 1, sb->n_shards, sb->n_inodes, N_INODES);
+	int b0 = SHARD_START(k, sb->n_shards, sb->n_blocks, N_BLOCKS);
+	int b1 = SHARD_START(k + 1, sb->n_shards, sb->n_blocks, N_BLOCKS);
+
+	for (int i = i0; i < i1; i++) {
+		img->bitmap_inodes.free_inodes[i] = shard->bitmap_inodes.free_inodes[i];
+		img->inodes[i] = shard->inodes[i];
+	}
+
+	for (int b = b0; b < b1; b++) {
+		img->bitmap_blocks.free_blocks[b] = shard->bitmap_blocks.free_blocks[b];
+		img->block_fill[b] = shard->block_fill[b];
+		img->block_next[b] = shard->block_next[b];
+		memcpy(img->data[b], shard->data[b], BLOCK_SIZE);
+	}
+}
+
+static int
+load_image(const char *path, struct image *img)
+{
+	if (read_image(path, img) < 0)
+		return -1;
+
+	int n_shards = img->sb.n_shards;
+
+	if (n_shards < 1 || n_shards > MAX_SHARDS) {
+		fprintf(stderr, "%s: %d shards, cannot be loaded\n", path, n_shards);
+		return -1;
+	}
+
+	if (n_shards == 1)
+		return 0;
+
+	struct image *shard = malloc(sizeof(struct image));
+	char shard_file[FILENAME_MAX];
+	int ret = 0;
+
+	for (int k = 1; k < n_shards && ret == 0; k++) {
+		shard_path(path, k, shard_file);
+		if (!shard || read_image(shard_file, shard) < 0) {
+			ret = -1;
+		} else if (shard->sb.n_shards != n_shards ||
+		           shard->sb.n_blocks != img->sb.n_blocks ||
+		           shard->sb.n_inodes != img->sb.n_inodes) {
+			fprintf(stderr, "%s: not a shard of %s\n", shard_file, path);
+			ret = -1;
+		} else {
+			take_shard(img, shard, k);
+		}
+	}
+
+	free(shard);
+
+	return ret;
+}
+
+// write_shard(tmp, img, k);
+// Writes the file of shard k to tmp. Holes read back as zeros, but the tables
+// must reach the data region for read_image to take the file.
+
+static int
+write_shard(const char *tmp, struct image *img, int k)
+{
+	FILE *file = fopen(tmp, "wb");
+
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	struct slice slices[MAX_SLICES];
+	int n = shard_slices(img, k, slices);
+	int ok = fwrite(&img->sb, sizeof(struct superblock), 1, file) == 1;
+
+	for (int i = 0; i < n && ok; i++)
+		ok = slices[i].size == 0 ||
+		     (fseek(file, slices[i].off, SEEK_SET) == 0 &&
+		      fwrite(slices[i].data, slices[i].size, 1, file) == 1);
+
+	if (ok && fseek(file, 0, SEEK_END) == 0 && ftell(file) < DATA_OFFSET)
+		ok = fseek(file, DATA_OFFSET - 1, SEEK_SET) == 0 &&
+		     fputc(0, file) == 0;  // A shard without blocks
+
+	if (fclose(file) != 0 || !ok) {
+		fprintf(stderr, "%s: error writing image\n", tmp);
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+// save_image(path, img);
+// Writes every shard to a temporary file, and only once all of them are
+// written renames them over the old ones, so an error or a crash halfway
+// doesn't leave shards of different versions
+
+static int
+save_image(const char *path, struct image *img)
+{
+	char shard_file[FILENAME_MAX];
+	char tmp[MAX_SHARDS][FILENAME_MAX + 8];
+	int n_shards = img->sb.n_shards;
+	int k;
+
+	for (k = 0; k < n_shards; k++) {
+		shard_path(path, k, shard_file);
+		snprintf(tmp[k], sizeof(tmp[k]), "%s.tmp", shard_file);
+		if (write_shard(tmp[k], img, k) < 0)
+			break;
+	}
+
+	if (k < n_shards) {
+		while (k-- > 0)
+			remove(tmp[k]);
+		return -1;
+	}
+
+	for (k = 0; k < n_shards; k++) {
+		shard_path(path, k, shard_file);
+		if (rename(tmp[k], shard_file) != 0) {
+			fprintf(stderr, "%s: %s\n", shard_file, strerror(errno));
+			for (; k < n_shards; k++)
+				remove(tmp[k]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+init_inode(struct inode *inode, mode_t mode)
+{
+	memset(inode, 0, sizeof(struct inode));
+	inode->st_mode = mode;
+	inode->st_uid = getuid();
+	inode->st_gid = getgid();
+	inode->st_atime = inode->st_mtime = inode->st_ctime = time(NULL);
+	inode->ref = -1;
+}
+
+static int
+alloc_inode(struct image *img, mode_t mode)
+{
+	for (int i = 0; i < img->sb.n_inodes; i++) {
+		if (!img->bitmap_inodes.free_inodes[i]) {
+			img->bitmap_inodes.free_inodes[i] = 1;
+			init_inode(&img->inodes[i], mode);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int
+mkfs(const char *path, int n_blocks, int n_inodes, int n_shards, int force)
+{
+	FILE *file = fopen(path, "rb");
+
+	if (file && !force) {
+		fclose(file);
+		fprintf(stderr, "%s already exists, use -f to overwrite it\n", path);
+		return 1;
+	}
+	if (file)
+		fclose(file);
+
+	struct image *img = calloc(1, sizeof(struct image));
+	if (!img)
+		return 1;
+
+	img->sb.magic = SUPERBLOCK_MAGIC;
+	img->sb.n_dirs = 1;  // One dir: root
+	img->sb.n_files = 0;
+	img->sb.n_blocks = n_blocks;
+	img->sb.n_inodes = n_inodes;
+	img->sb.n_shards = n_shards;
+
+	for (int i = 0; i < N_BLOCKS; i++)
+		img->block_next[i] = -1;
+
+	int ino = alloc_inode(img, __S_IFDIR | 0775);
+
+	struct dirent *root = &img->dirs[0];
+	root->parent = -1;  // The root has no name
+	root->d_ino = ino;
+	root->level = 1;
+
+	int ret = save_image(path, img);
+	if (ret == 0)
+		printf("%s: %d blocks of %d bytes, %d inodes, %d shards\n",
+		       path,
+		       n_blocks,
+		       BLOCK_SIZE,
+		       n_inodes,
+		       n_shards);
+
+	free(img);
+
+	return ret < 0;
+}
+
+// Checks report every problem they find and, when fixing, repair it right
+// away so later checks see consistent tables
+
+struct check {
+	int fix;
+	int problems;
+	int refs[N_BLOCKS];  // references counted from the chains
+};
+
+static void
+problem(struct check *c, const char *fmt, const char *what, int n)
+{
+	c->problems++;
+	printf(fmt, what, n);
+	printf(c->fix ? " (fixed)\n" : "\n");
+}
+
+static int
+file_live(struct image *img, int n_file)
+{
+	return n_file >= 0 && n_file < img->sb.n_files && img->files[n_file].name.len;
+}
+
+static int
+dir_live(struct image *img, int n_dir)
+{
+	return n_dir == 0 ||
+	       (n_dir > 0 && n_dir < img->sb.n_dirs && img->dirs[n_dir].name.len);
+}
+
+static int
+name_ok(struct name_ref ref)
+{
+	return ref.len > 0 && ref.len <= NAME_MAX_LEN && ref.off >= 0 &&
+	       ref.off <= NAME_ARENA_SIZE - ref.len;
+}
+
+static int
+name_in_arena(struct image *img, struct name_ref ref)
+{
+	return name_ok(ref) && ref.off + ref.len <= img->names.used;
+}
+
+// The tool interns names by scanning the tables instead of keeping an index.
+// Any ref whose bytes in the arena are the name will do, so this also works
+// halfway through a compaction, when some refs still point to the old arena.
+
+static void
+find_name(struct image *img,
+          struct name_ref *found,
+          const char *name,
+          int len,
+          struct file *files,
+          int n_files,
+          struct dirent *dirs,
+          int n_dirs)
+{
+	for (int i = 0; !found->len && i < n_files && i < N_INODES; i++)
+		if (files[i].name.len == len && name_ok(files[i].name) &&
+		    files[i].name.off + len <= img->names.used &&
+		    memcmp(img->names.data + files[i].name.off, name, len) == 0)
+			*found = files[i].name;
+
+	for (int d = 1; !found->len && d < n_dirs && d < N_INODES; d++)
+		if (dirs[d].name.len == len && name_ok(dirs[d].name) &&
+		    dirs[d].name.off + len <= img->names.used &&
+		    memcmp(img->names.data + dirs[d].name.off, name, len) == 0)
+			*found = dirs[d].name;
+}
+
+// add_name(img, name, len);
+// return: ref to the name, shared with an equal one already stored, len is 0
+// if the arena is full
+
+static struct name_ref
+add_name(struct image *img, const char *name, int len)
+{
+	struct name_ref ref = { 0, 0 };
+
+	find_name(img, &ref, name, len, img->files, img->sb.n_files, img->dirs,
+	          img->sb.n_dirs);
+	for (int s = 0; s < N_SNAPSHOTS; s++)
+		if (img->snapshots[s].used)
+			find_name(img, &ref, name, len, img->snapshots[s].files,
+			          img->snapshots[s].sb.n_files, img->snapshots[s].dirs,
+			          img->snapshots[s].sb.n_dirs);
+
+	if (ref.len || len > NAME_ARENA_SIZE - img->names.used)
+		return ref;
+
+	ref.off = img->names.used;
+	ref.len = len;
+	memcpy(img->names.data + ref.off, name, len);
+	img->names.used += len;
+
+	return ref;
+}
+
+static void
+move_names(struct image *img, struct name_arena *old, struct file *files,
+           int n_files, struct dirent *dirs, int n_dirs)
+{
+	for (int i = 0; i < n_files && i < N_INODES; i++)
+		if (name_ok(files[i].name))
+			files[i].name = add_name(img, old->data + files[i].name.off,
+			                         files[i].name.len);
+
+	for (int d = 1; d < n_dirs && d < N_INODES; d++)
+		if (name_ok(dirs[d].name))
+			dirs[d].name = add_name(img, old->data + dirs[d].name.off,
+			                        dirs[d].name.len);
+}
+
+// compact_names(img);
+// Rewrites the arena with only the names the tables refer to, once each
+// return: bytes reclaimed
+
+static int
+compact_names(struct image *img)
+{
+	struct name_arena *old = malloc(sizeof(struct name_arena));
+	memcpy(old, &img->names, sizeof(struct name_arena));
+	memset(&img->names, 0, sizeof(struct name_arena));
+
+	move_names(img, old, img->files, img->sb.n_files, img->dirs, img->sb.n_dirs);
+	for (int s = 0; s < N_SNAPSHOTS; s++)
+		if (img->snapshots[s].used)
+			move_names(img, old, img->snapshots[s].files,
+			           img->snapshots[s].sb.n_files, img->snapshots[s].dirs,
+			           img->snapshots[s].sb.n_dirs);
+
+	int reclaimed = old->used - img->names.used;
+	free(old);
+
+	return reclaimed;
+}
+
+static void
+drop_file(struct image *img, int n_file)
+{
+	memset(&img->files[n_file], 0, sizeof(struct file));
+}
+
+// check_chain(c, img, inode, what, n);
+// Walks an inode's block chain, which must have st_blocks valid blocks whose
+// fills add up to st_size, and counts a reference to each block
+
+static void
+check_chain(struct check *c, struct image *img, struct inode *inode, const char *what, int n)
+{
+	int id_block = inode->ref;
+	int j = 0;
+	off_t size = 0;
+
+	while (j < inode->st_blocks && j < N_BLOCKS_INODE && id_block >= 0 &&
+	       id_block < img->sb.n_blocks) {
+		int fill = img->block_fill[id_block];
+
+		if (fill < 0 || fill > BLOCK_SIZE) {
+			problem(c, "%s %d: block with a bad fill level", what, n);
+			if (c->fix)
+				img->block_fill[id_block] = fill < 0 ? 0 : BLOCK_SIZE;
+			fill = img->block_fill[id_block];
+		}
+
+		c->refs[id_block]++;
+		size += fill;
+		id_block = img->block_next[id_block];
+		j++;
+	}
+
+	if (j != inode->st_blocks) {
+		problem(c, "%s %d: block chain shorter than st_blocks", what, n);
+		if (c->fix) {
+			inode->st_blocks = j;
+			if (j == 0)
+				inode->ref = -1;
+		}
+	}
+
+	if (size != inode->st_size && S_ISREG(inode->st_mode)) {
+		problem(c, "%s %d: size does not match its blocks", what, n);
+		if (c->fix)
+			inode->st_size = size;
+	}
+}
+
+static int
+is_name(struct image *img, struct name_ref ref, const char *name)
+{
+	return name_ok(ref) && ref.len == (int) strlen(name) &&
+	       memcmp(img->names.data + ref.off, name, ref.len) == 0;
+}
+
+// lost_found(img);
+// return: index of /lost+found, created if needed, -1 if there is no room
+
+static int
+lost_found(struct image *img)
+{
+	for (int d = 1; d < img->sb.n_dirs; d++)
+		if (img->dirs[d].parent == 0 && is_name(img, img->dirs[d].name, LOST_FOUND))
+			return d;
+
+	struct name_ref name = add_name(img, LOST_FOUND, strlen(LOST_FOUND));
+	int ino;
+
+	if (img->sb.n_dirs >= N_INODES || !name.len ||
+	    (ino = alloc_inode(img, __S_IFDIR | 0700)) < 0)
+		return -1;
+
+	struct dirent *dir = &img->dirs[img->sb.n_dirs];
+	memset(dir, 0, sizeof(struct dirent));
+	dir->name = name;
+	dir->parent = 0;
+	dir->d_ino = ino;
+	dir->level = 2;
+
+	return img->sb.n_dirs++;
+}
+
+// recover(img, d_ino);
+// Links an orphan inode into /lost+found as #<inode>
+// return: inode of /lost+found, -1 if there is no room for it
+
+static int
+recover(struct image *img, int d_ino)
+{
+	int d = lost_found(img);
+	if (d < 0)
+		return -1;
+
+	int n_file = img->sb.n_files;
+
+	for (int i = 0; i < img->sb.n_files; i++)
+		if (img->files[i].name.len == 0)
+			n_file = i;
+
+	char name[16];
+	snprintf(name, sizeof(name), "#%d", d_ino);
+	struct name_ref ref = add_name(img, name, strlen(name));
+
+	if (n_file >= N_INODES || !ref.len)
+		return -1;
+
+	struct file *file = &img->files[n_file];
+	file->name = ref;
+	file->parent = d;
+	file->d_ino = d_ino;
+
+	if (n_file == img->sb.n_files)
+		img->sb.n_files++;
+
+	return img->dirs[d].d_ino;
+}
+
+// fsck(img, fix);
+// return: number of problems found
+
+static int
+fsck(struct image *img, int fix)
+{
+	struct check *c = calloc(1, sizeof(struct check));
+	struct superblock *sb = &img->sb;
+	int problems;
+
+	c->fix = fix;
+
+	if (sb->n_blocks <= 0 || sb->n_blocks > N_BLOCKS || sb->n_inodes <= 0 ||
+	    sb->n_inodes > N_INODES || sb->n_files < 0 || sb->n_files > N_INODES ||
+	    sb->n_dirs < 1 || sb->n_dirs > N_INODES) {
+		printf("superblock: geometry or table sizes out of range, "
+		       "cannot repair\n");
+		free(c);
+		return 1;
+	}
+
+	if (img->names.used < 0 || img->names.used > NAME_ARENA_SIZE) {
+		problem(c, "%s: %d bytes used, out of range", "name arena", img->names.used);
+		if (fix)
+			img->names.used = NAME_ARENA_SIZE;
+	}
+
+	// Dirs need a name in the arena and a live parent
+	for (int d = 1; d < sb->n_dirs; d++) {
+		struct dirent *dir = &img->dirs[d];
+
+		if (!dir_live(img, d))
+			continue;
+
+		if (!name_in_arena(img, dir->name)) {
+			problem(c, "%s %d: bad name", "dir", d);
+			if (fix)  // Its files are recovered below
+				memset(dir, 0, sizeof(struct dirent));
+			continue;
+		}
+
+		if (!dir_live(img, dir->parent) || dir->parent == d) {
+			problem(c, "%s %d: parent dir was removed", "dir", d);
+			if (fix)
+				dir->parent = 0;
+		}
+	}
+
+	// Files need a name, a live parent and an inode of their own. The ones
+	// that are dropped leave their inode orphan, so it is recovered below
+	int owned[N_INODES] = { 0 };
+
+	for (int i = 0; i < sb->n_files; i++) {
+		struct file *file = &img->files[i];
+
+		if (!file_live(img, i))
+			continue;
+
+		if (file->d_ino < 0 || file->d_ino >= sb->n_inodes ||
+		    !img->bitmap_inodes.free_inodes[file->d_ino] ||
+		    owned[file->d_ino]) {
+			problem(c, "%s %d: points to a free or shared inode", "file", i);
+			if (fix)
+				drop_file(img, i);
+			continue;
+		}
+
+		owned[file->d_ino] = 1;
+
+		const char *why = NULL;
+
+		if (!name_in_arena(img, file->name))
+			why = "%s %d: bad name";
+		else if (!dir_live(img, file->parent))
+			why = "%s %d: parent dir was removed";
+
+		for (int j = 0; !why && j < i; j++)
+			if (file_live(img, j) && img->files[j].parent == file->parent &&
+			    name_in_arena(img, img->files[j].name) &&
+			    img->files[j].name.len == file->name.len &&
+			    memcmp(img->names.data + img->files[j].name.off,
+			           img->names.data + file->name.off,
+			           file->name.len) == 0)
+				why = "%s %d: same name as another file in its dir";
+
+		if (why) {
+			int d_ino = file->d_ino;
+
+			problem(c, why, "file", i);
+			if (fix)
+				drop_file(img, i);
+			owned[d_ino] = !fix;  // Recovered below as an orphan
+		}
+	}
+
+	for (int d = 0; d < sb->n_dirs; d++) {
+		int d_ino = img->dirs[d].d_ino;
+
+		if (!dir_live(img, d))
+			continue;
+
+		if (d_ino < 0 || d_ino >= sb->n_inodes ||
+		    !img->bitmap_inodes.free_inodes[d_ino] || owned[d_ino]) {
+			printf("dir %d: points to a bad inode, cannot repair\n", d);
+			c->problems++;
+			continue;
+		}
+		owned[d_ino] = 1;
+	}
+
+	// Allocated inodes nobody points to are orphans
+	for (int i = 0; i < N_INODES; i++) {
+		int used = img->bitmap_inodes.free_inodes[i];
+
+		if (i >= sb->n_inodes && used) {
+			problem(c, "%s %d: allocated past the geometry", "inode", i);
+			if (fix)
+				img->bitmap_inodes.free_inodes[i] = 0;
+			continue;
+		}
+
+		if (!used || owned[i])
+			continue;
+
+		struct inode *inode = &img->inodes[i];
+		int has_data = S_ISREG(inode->st_mode) && inode->st_blocks > 0;
+
+		problem(c, "%s %d: orphan", "inode", i);
+		if (!fix)
+			continue;
+
+		int lf_ino = has_data ? recover(img, i) : -1;
+
+		if (lf_ino >= 0) {
+			owned[lf_ino] = 1;  // Allocated just now, maybe past i
+			printf("  recovered into /%s/#%d\n", LOST_FOUND, i);
+		} else {
+			img->bitmap_inodes.free_inodes[i] = 0;
+			memset(inode, 0, sizeof(struct inode));
+			inode->ref = -1;
+		}
+	}
+
+	// Block chains of the live inodes and of every snapshot
+	for (int i = 0; i < sb->n_inodes; i++)
+		if (img->bitmap_inodes.free_inodes[i])
+			check_chain(c, img, &img->inodes[i], "inode", i);
+
+	for (int s = 0; s < N_SNAPSHOTS; s++) {
+		struct snapshot *snap = &img->snapshots[s];
+
+		for (int i = 0; snap->used && i < N_INODES; i++)
+			if (snap->bitmap_inodes.free_inodes[i])
+				check_chain(c, img, &snap->inodes[i], snap->name, i);
+	}
+
+	// Block refcounts must match the chains, free blocks must be clean
+	for (int b = 0; b < N_BLOCKS; b++) {
+		if (img->bitmap_blocks.free_blocks[b] != c->refs[b]) {
+			problem(c,
+			        c->refs[b] ? "%s %d: wrong reference count"
+			                   : "%s %d: marked used but unreferenced",
+			        "block",
+			        b);
+			if (fix)
+				img->bitmap_blocks.free_blocks[b] = c->refs[b];
+		}
+
+		if (!c->refs[b] && fix) {
+			img->block_fill[b] = 0;
+			img->block_next[b] = -1;
+			memset(img->data[b], 0, BLOCK_SIZE);
+		}
+	}
+
+	problems = c->problems;
+	free(c);
+
+	return problems;
+}
+
+// extents(img, inode);
+// return: number of contiguous runs the inode's data is split into
+
+static int
+extents(struct image *img, struct inode *inode)
+{
+	int id_block = inode->ref;
+	int runs = 0;
+
+	for (int j = 0, prev = -2; j < inode->st_blocks && id_block >= 0; j++) {
+		if (id_block != prev + 1)
+			runs++;
+		prev = id_block;
+		id_block = img->block_next[id_block];
+	}
+
+	return runs;
+}
+
+// path_of(img, n_dir, name, buf);
+// Builds the path of the entry called name in dir n_dir, walking up the
+// parents. Loops in a broken image are cut at the max depth.
+
+static void
+path_of(struct image *img, int n_dir, struct name_ref name, char buf[PATH_LEN])
+{
+	struct name_ref chain[MAX_DEPTH_DIR + 1];
+	int depth = 0;
+	size_t len = 0;
+
+	if (name.len)
+		chain[depth++] = name;
+
+	while (n_dir > 0 && n_dir < N_INODES && depth < MAX_DEPTH_DIR + 1) {
+		chain[depth++] = img->dirs[n_dir].name;
+		n_dir = img->dirs[n_dir].parent;
+	}
+
+	strcpy(buf, "/");
+
+	while (depth-- > 0) {
+		struct name_ref ref = chain[depth];
+		int ok = name_in_arena(img, ref);
+
+		len += snprintf(buf + len,
+		                PATH_LEN - len,
+		                "/%.*s",
+		                ok ? ref.len : 1,
+		                ok ? img->names.data + ref.off : "?");
+	}
+}
+
+static void
+dump(struct image *img)
+{
+	struct superblock *sb = &img->sb;
+	int inodes_used = 0, blocks_used = 0, blocks_shared = 0;
+	long bytes = 0;
+	int files_live = 0, fragmented = 0, runs = 0, tombstones = 0;
+	int dirs_live = 0, refs = 0;
+	char path[PATH_LEN];
+
+	for (int i = 0; i < sb->n_inodes; i++)
+		inodes_used += img->bitmap_inodes.free_inodes[i] != 0;
+
+	for (int b = 0; b < sb->n_blocks; b++) {
+		blocks_used += img->bitmap_blocks.free_blocks[b] > 0;
+		blocks_shared += img->bitmap_blocks.free_blocks[b] > 1;
+		if (img->bitmap_blocks.free_blocks[b] > 0)
+			bytes += img->block_fill[b];
+	}
+
+	printf("superblock: magic %d, %d files, %d dirs, %d shards\n",
+	       sb->magic,
+	       sb->n_files,
+	       sb->n_dirs,
+	       sb->n_shards);
+	printf("geometry:   %d blocks of %d bytes, %d inodes "
+	       "(build maximum %d blocks, %d inodes)\n",
+	       sb->n_blocks,
+	       BLOCK_SIZE,
+	       sb->n_inodes,
+	       N_BLOCKS,
+	       N_INODES);
+	printf("inodes:     %d used, %d free\n", inodes_used, sb->n_inodes - inodes_used);
+	printf("blocks:     %d used (%d shared), %d free, "
+	       "%ld bytes of data\n",
+	       blocks_used,
+	       blocks_shared,
+	       sb->n_blocks - blocks_used,
+	       bytes);
+
+	printf("\nfiles:\n");
+	for (int i = 0; i < sb->n_files && i < N_INODES; i++) {
+		struct file *file = &img->files[i];
+
+		if (file->name.len == 0) {
+			tombstones++;
+			continue;
+		}
+
+		refs++;
+		path_of(img, file->parent, file->name, path);
+
+		if (file->d_ino < 0 || file->d_ino >= N_INODES) {
+			printf("  %3d  %-41s  bad inode %d\n", i, path, file->d_ino);
+			continue;
+		}
+
+		struct inode *inode = &img->inodes[file->d_ino];
+		int n_runs = extents(img, inode);
+
+		files_live++;
+		runs += n_runs;
+		fragmented += n_runs > 1;
+		printf("  %3d  %-41s  inode %2d  %5ld bytes  %2ld blocks  %d runs  %04o\n",
+		       i,
+		       path,
+		       file->d_ino,
+		       (long) inode->st_size,
+		       (long) inode->st_blocks,
+		       n_runs,
+		       inode->st_mode & 07777);
+	}
+
+	printf("\ndirs:\n");
+	for (int d = 0; d < sb->n_dirs && d < N_INODES; d++) {
+		struct dirent *dir = &img->dirs[d];
+		int entries = 0, subdirs = 0;
+
+		if (!dir_live(img, d)) {
+			printf("  %3d  (removed)\n", d);
+			continue;
+		}
+
+		for (int i = 0; i < sb->n_files && i < N_INODES; i++)
+			entries += file_live(img, i) && img->files[i].parent == d;
+		for (int j = 1; j < sb->n_dirs && j < N_INODES; j++)
+			subdirs += dir_live(img, j) && img->dirs[j].parent == d;
+
+		dirs_live++;
+		refs += d > 0;
+		path_of(img, d, (struct name_ref){ 0, 0 }, path);
+		printf("  %3d  %-41s  inode %2d  parent %2d  %d files, %d dirs\n",
+		       d,
+		       path,
+		       dir->d_ino,
+		       dir->parent,
+		       entries,
+		       subdirs);
+	}
+
+	printf("\nsnapshots:\n");
+	for (int s = 0; s < N_SNAPSHOTS; s++) {
+		struct snapshot *snap = &img->snapshots[s];
+		char date[32];
+
+		if (!snap->used)
+			continue;
+
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&snap->created));
+		printf("  %-20s  %s  %d files, %d dirs\n",
+		       snap->name,
+		       date,
+		       snap->sb.n_files,
+		       snap->sb.n_dirs);
+	}
+
+	printf("\nusage: %d live files in %d runs (%d fragmented), "
+	       "%d removed file slots\n",
+	       files_live,
+	       runs,
+	       fragmented,
+	       tombstones);
+
+	// What the metadata of each live inode costs: the inode, its bitmap
+	// entry, its file or dir entry and its share of the name arena
+	int n_inodes = files_live + dirs_live;
+	long meta = (long) files_live * sizeof(struct file) +
+	            (long) dirs_live * sizeof(struct dirent) +
+	            (long) n_inodes * (sizeof(struct inode) + sizeof(int)) +
+	            img->names.used;
+
+	printf("names: %d of %d arena bytes used by %d live names (and "
+	       "snapshots)\n",
+	       img->names.used,
+	       NAME_ARENA_SIZE,
+	       refs);
+	printf("metadata: %ld bytes per inode (inode %zu, file %zu, dir %zu, "
+	       "names %d)\n",
+	       n_inodes ? meta / n_inodes : 0,
+	       sizeof(struct inode),
+	       sizeof(struct file),
+	       sizeof(struct dirent),
+	       n_inodes ? img->names.used / n_inodes : 0);
+}
+
+// defrag(img);
+// Renumbers the blocks so each chain is a contiguous run, in the order the
+// files appear, and compacts the removed slots of the file table and the name
+// arena. Renumbering is a permutation, so chains shared with snapshots stay
+// shared.
+
+static void
+defrag(struct image *img)
+{
+	struct superblock *sb = &img->sb;
+	int map[N_BLOCKS];
+	int runs_before = 0, runs_after = 0;
+	int n = 0;
+
+	for (int b = 0; b < N_BLOCKS; b++)
+		map[b] = -1;
+
+	for (int pass = 0; pass <= N_SNAPSHOTS; pass++) {  // Live inodes first
+		struct inode *table = pass == 0 ? img->inodes
+		                                : img->snapshots[pass - 1].inodes;
+		struct file *files = pass == 0 ? img->files : img->snapshots[pass - 1].files;
+		int n_files = pass == 0 ? sb->n_files : img->snapshots[pass - 1].sb.n_files;
+
+		if (pass > 0 && !img->snapshots[pass - 1].used)
+			continue;
+
+		for (int i = 0; i < n_files; i++) {
+			if (files[i].name.len == 0)
+				continue;
+
+			if (files[i].d_ino < 0 || files[i].d_ino >= N_INODES)
+				continue;
+
+			struct inode *inode = &table[files[i].d_ino];
+			int id_block = inode->ref;
+
+			if (pass == 0)
+				runs_before += extents(img, inode);
+
+			for (int j = 0; j < inode->st_blocks && id_block >= 0; j++) {
+				if (map[id_block] < 0)
+					map[id_block] = n++;
+				id_block = img->block_next[id_block];
+			}
+		}
+	}
+
+	for (int b = 0; b < N_BLOCKS; b++)  // Unreferenced blocks go last
+		if (map[b] < 0 && img->bitmap_blocks.free_blocks[b] > 0)
+			map[b] = n++;
+	for (int b = 0; b < N_BLOCKS; b++)
+		if (map[b] < 0)
+			map[b] = n++;
+
+	struct image *old = malloc(sizeof(struct image));
+	memcpy(old, img, sizeof(struct image));
+
+	for (int b = 0; b < N_BLOCKS; b++) {
+		int to = map[b];
+		int next = old->block_next[b];
+
+		img->bitmap_blocks.free_blocks[to] = old->bitmap_blocks.free_blocks[b];
+		img->block_fill[to] = old->block_fill[b];
+		img->block_next[to] = next >= 0 ? map[next] : -1;
+		memcpy(img->data[to], old->data[b], BLOCK_SIZE);
+	}
+
+	for (int i = 0; i < N_INODES; i++)
+		if (img->inodes[i].ref >= 0)
+			img->inodes[i].ref = map[img->inodes[i].ref];
+
+	for (int s = 0; s < N_SNAPSHOTS; s++)
+		for (int i = 0; img->snapshots[s].used && i < N_INODES; i++)
+			if (img->snapshots[s].inodes[i].ref >= 0)
+				img->snapshots[s].inodes[i].ref =
+				        map[img->snapshots[s].inodes[i].ref];
+
+	free(old);
+
+	// Compact the file table, dirs refer to nothing in it
+	int n_files = 0;
+
+	for (int i = 0; i < sb->n_files; i++)
+		if (img->files[i].name.len)
+			img->files[n_files++] = img->files[i];
+
+	for (int i = n_files; i < sb->n_files; i++)
+		memset(&img->files[i], 0, sizeof(struct file));
+
+	int removed = sb->n_files - n_files;
+	sb->n_files = n_files;
+
+	int reclaimed = compact_names(img);
+
+	for (int i = 0; i < sb->n_files; i++)
+		runs_after += extents(img, &img->inodes[img->files[i].d_ino]);
+
+	printf("%d runs before, %d after; %d removed slots compacted, %d name "
+	       "bytes reclaimed\n",
+	       runs_before,
+	       runs_after,
+	       removed,
+	       reclaimed);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s mkfs [-f] [-b blocks] [-i inodes] [-s shards] image\n"
+	        "       %s fsck [-n] image\n"
+	        "       %s dump image\n"
+	        "       %s defrag image\n"
+	        "  mkfs    create an empty image, with at most %d blocks and %d "
+	        "inodes\n"
+	        "          split in up to %d files (-f overwrites an existing "
+	        "image)\n"
+	        "  fsck    check and repair the image (-n only reports problems)\n"
+	        "  dump    print the tables and usage stats\n"
+	        "  defrag  make every file contiguous and compact the file "
+	        "tables\n",
+	        prog,
+	        prog,
+	        prog,
+	        prog,
+	        N_BLOCKS,
+	        N_INODES,
+	        MAX_SHARDS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	const char *cmd = argv[1];
+	const char *path = argv[argc - 1];
+	int n_blocks = N_BLOCKS, n_inodes = N_INODES, n_shards = 1;
+	int force = 0, dry_run = 0;
+
+	for (int i = 2; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-f") == 0) {
+			force = 1;
+		} else if (strcmp(argv[i], "-n") == 0) {
+			dry_run = 1;
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc - 1) {
+			n_blocks = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc - 1) {
+			n_inodes = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc - 1) {
+			n_shards = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (strcmp(cmd, "mkfs") == 0) {
+		if (n_blocks < 1 || n_blocks > N_BLOCKS || n_inodes < 2 ||
+		    n_inodes > N_INODES || n_shards < 1 || n_shards > MAX_SHARDS) {
+			fprintf(stderr,
+			        "geometry must be 1-%d blocks, 2-%d inodes and 1-%d "
+			        "shards\n",
+			        N_BLOCKS,
+			        N_INODES,
+			        MAX_SHARDS);
+			return 2;
+		}
+		return mkfs(path, n_blocks, n_inodes, n_shards, force);
+	}
+
+	struct image *img = malloc(sizeof(struct image));
+	int ret = 0;
+
+	if (!img || load_image(path, img) < 0) {
+		free(img);
+		return 1;
+	}
+
+	if (strcmp(cmd, "fsck") == 0) {
+		int problems = fsck(img, !dry_run);
+
+		printf("%s: %d problems%s\n",
+		       path,
+		       problems,
+		       problems && !dry_run ? " fixed" : "");
+		if (problems && !dry_run && save_image(path, img) < 0)
+			ret = 1;
+		else if (problems)
+			ret = dry_run ? 1 : 0;
+	} else if (strcmp(cmd, "dump") == 0) {
+		dump(img);
+	} else if (strcmp(cmd, "defrag") == 0) {
+		if (fsck(img, 0) > 0) {
+			fprintf(stderr, "%s has errors, run fsck first\n", path);
+			ret = 1;
+		} else {
+			defrag(img);
+			ret = save_image(path, img) < 0;
+		}
+	} else {
+		usage(argv[0]);
+		ret = 2;
+	}
+
+	free(img);
+
+	return ret;
+}
@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 30
+#define FUSE_USE_VERSION 31
 
 #include <unistd.h>
 #include <fuse.h>
@@ -9,33 +9,397 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "fisopfs.h"
 
+#ifndef UTIME_NOW  // Hidden by strict C11, values from the kernel ABI
+#define UTIME_NOW ((1l << 30) - 1l)
+#define UTIME_OMIT ((1l << 30) - 2l)
+#endif
+
 char file_name[MAX_FILE_NAME_SIZE] = "file_system.fisopfs";
 
+// Messages are filtered by the log= mount option. Errors always go to stderr.
+
+int log_level = LOG_DEBUG;
+int print_stats = 0;  // Report usage stats on unmount, set by the stats option
+
+#define log_debug(...)                                                         \
+	do {                                                                   \
+		if (log_level >= LOG_DEBUG)                                    \
+			printf(__VA_ARGS__);                                   \
+	} while (0)
+
+#define log_info(...)                                                          \
+	do {                                                                   \
+		if (log_level >= LOG_INFO)                                     \
+			printf(__VA_ARGS__);                                   \
+	} while (0)
+
+#define log_error(...) fprintf(stderr, __VA_ARGS__)
+
+// With the trace= option every FUSE operation is appended to a trace file,
+// see struct trace_record. Records are written with a single fwrite, which
+// stdio locks, so concurrent readers and writers do not interleave them.
+
+FILE *trace_file;      // NULL unless capturing
+long long trace_base;  // Clock at the start of the capture
+
+long long
+trace_now()
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// trace_begin();
+// return: start time of an operation, the clock is only read while capturing
+
+long long
+trace_begin()
+{
+	return trace_file ? trace_now() : 0;
+}
+
+// trace_arg(op, start, path, arg, arg_len, offset, size, flags, fh, result);
+// Appends a record for an operation that started at start, and its path and
+// argument, to the trace
+
+void
+trace_arg(int op,
+          long long start,
+          const char *path,
+          const char *arg,
+          size_t arg_len,
+          long long offset,
+          unsigned int size,
+          unsigned int flags,
+          unsigned long long fh,
+          int result)
+{
+	if (!trace_file)
+		return;
+
+	char buf[sizeof(struct trace_record) + TRACE_MAX_LEN];
+	struct trace_record *rec = (struct trace_record *) buf;
+	size_t path_len = strlen(path);
+	long long latency = trace_now() - start;
+
+	if (path_len + arg_len > TRACE_MAX_LEN) {  // Kept whole or not at all
+		path_len = 0;
+		arg_len = 0;
+	}
+
+	memset(rec, 0, sizeof(struct trace_record));
+	rec->start = start - trace_base;
+	rec->offset = offset;
+	rec->fh = fh;
+	rec->latency = latency > UINT32_MAX ? UINT32_MAX : latency;
+	rec->size = size;
+	rec->flags = flags;
+	rec->result = result;
+	rec->op = op;
+	rec->path_len = path_len;
+	rec->arg_len = arg_len;
+	memcpy(buf + sizeof(struct trace_record), path, path_len);
+	if (arg_len)
+		memcpy(buf + sizeof(struct trace_record) + path_len, arg, arg_len);
+
+	fwrite(buf,
+	       sizeof(struct trace_record) + path_len + arg_len,
+	       1,
+	       trace_file);
+}
+
+void
+trace_op(int op,
+         long long start,
+         const char *path,
+         long long offset,
+         unsigned int size,
+         unsigned int flags,
+         unsigned long long fh,
+         int result)
+{
+	trace_arg(op, start, path, NULL, 0, offset, size, flags, fh, result);
+}
+
+unsigned long long
+trace_fh(struct fuse_file_info *fi)
+{
+	return fi ? fi->fh : 0;
+}
+
 struct superblock *sb;
 struct bmap_inodes *bitmap_inodes;
 struct bmap_blocks *bitmap_blocks;
 struct inode *inodes;
-struct block *blocks;
+char *block_data;  // N_BLOCKS * BLOCK_SIZE contiguous bytes, page aligned
+int *block_fill;   // bytes used in each block
+int *block_next;   // next block of the same file, -1 at the end of the chain
+int *block_resv;   // inode a free block is reserved for, -1 if none
 struct file *files;
 struct dirent *dirs;
+struct name_arena *names;
+struct name_ref *name_index;  // NAME_INDEX_SIZE entries, not persisted
+struct snapshot *snapshots;
+
+// Writers are serialized by fs_lock and bump fs_seq before and after changing
+// anything, so it is odd while a change is in progress. Metadata readers
+// (getattr, readdir) never take the lock: they read the tables inside a
+// seqlock read section and retry if fs_seq moved. The tables are allocated
+// for the whole mount, so a racing reader can only see inconsistent values,
+// which are bounds checked and then thrown away by the retry.
+
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+_Alignas(64) atomic_uint fs_seq;
+
+int atime_mode = ATIME_RELATIME;  // Set by the mount options
+int lazytime = 0;
+int writeback_cache = 1;  // Asked for unless nowriteback, then if granted
+int fs_dirty = 0;     // The image must be written back on unmount
+int times_dirty = 0;  // Timestamp changes deferred by lazytime
+time_t fs_clock = 0;  // Coarse clock, read once per operation
+
+void
+tick_clock()
+{
+	fs_clock = time(NULL);
+}
+
+void
+write_begin()
+{
+	pthread_mutex_lock(&fs_lock);
+	tick_clock();
+	atomic_store_explicit(&fs_seq,
+	                      atomic_load_explicit(&fs_seq, memory_order_relaxed) + 1,
+	                      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+// write_end(dirty);
+// recv: whether the operation changed something that must be persisted
+
+void
+write_end(int dirty)
+{
+	if (dirty)
+		fs_dirty = 1;
+	atomic_store_explicit(&fs_seq,
+	                      atomic_load_explicit(&fs_seq, memory_order_relaxed) + 1,
+	                      memory_order_release);
+	pthread_mutex_unlock(&fs_lock);
+}
+
+unsigned
+read_begin()
+{
+	unsigned seq;
+
+	while ((seq = atomic_load_explicit(&fs_seq, memory_order_acquire)) & 1)
+		sched_yield();  // A writer is halfway through a change
+
+	return seq;
+}
+
+int
+read_retry(unsigned seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&fs_seq, memory_order_relaxed) != seq;
+}
+
+// With lazytime, changes that only touch timestamps are kept in memory and
+// persisted along with the next real change, or on fsync and unmount at the
+// latest, as Linux does
+
+void
+times_changed()
+{
+	if (lazytime)
+		times_dirty = 1;
+	else
+		fs_dirty = 1;
+}
+
+void
+flush_times()
+{
+	if (times_dirty)
+		fs_dirty = 1;
+	times_dirty = 0;
+}
+
+// touch_atime(inode);
+// Updates atime on a read according to the atime mode. relatime only moves
+// it when it is older than mtime or ctime, or once every RELATIME_WINDOW
+
+void
+touch_atime(struct inode *inode)
+{
+	if (atime_mode == ATIME_NOATIME)
+		return;
+
+	if (atime_mode == ATIME_RELATIME && inode->st_atime > inode->st_mtime &&
+	    inode->st_atime > inode->st_ctime &&
+	    fs_clock - inode->st_atime < RELATIME_WINDOW)
+		return;
+
+	if (inode->st_atime != fs_clock) {
+		inode->st_atime = fs_clock;
+		times_changed();
+	}
+}
+
+void
+touch_mtime(struct inode *inode)
+{
+	inode->st_mtime = inode->st_ctime = fs_clock;
+	times_changed();
+}
+
+void
+touch_ctime(struct inode *inode)
+{
+	inode->st_ctime = fs_clock;
+	times_changed();
+}
+
+// caller_uid();
+// return: uid of the process that made the request. Without a FUSE session
+// (fisopfs-replay) there is no caller, and the requests are our own.
+
+int in_fuse = 0;  // Set once fuse_main runs
+
+uid_t
+caller_uid()
+{
+	struct fuse_context *context = in_fuse ? fuse_get_context() : NULL;
+
+	return context ? context->uid : getuid();
+}
+
+// Invalidations of the kernel's cache wait in a list until their request has
+// been replied to: the kernel may hold the inode's lock until then, so
+// invalidating from inside the handler can deadlock. A helper thread drains
+// the list.
+
+struct invalidation {
+	struct invalidation *next;
+	char path[];
+};
+
+struct invalidation *pending_invals = NULL;
+pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+pthread_t inval_thread;
+int inval_started = 0;
+int inval_stop = 0;
+struct fuse *inval_fuse = NULL;
+
+void *
+drain_invalidations(void *arg)
+{
+	pthread_mutex_lock(&inval_lock);
+	for (;;) {
+		while (!pending_invals && !inval_stop)
+			pthread_cond_wait(&inval_cond, &inval_lock);
+		if (!pending_invals)
+			break;
+
+		struct invalidation *inval = pending_invals;
+		pending_invals = inval->next;
+		pthread_mutex_unlock(&inval_lock);
+
+		fuse_invalidate_path(inval_fuse, inval->path);  // Waits for the reply
+		free(inval);
+
+		pthread_mutex_lock(&inval_lock);
+	}
+	pthread_mutex_unlock(&inval_lock);
+
+	return NULL;
+}
+
+// invalidate_later(path);
+// Queues path to have its cached pages and attributes dropped by the kernel
+// once the current request has been replied to
+
+void
+invalidate_later(const char *path)
+{
+	if (!in_fuse)
+		return;
+
+	size_t len = strlen(path) + 1;
+	struct invalidation *inval = malloc(sizeof(*inval) + len);
+
+	if (!inval) {
+		log_error("fisopfs: can't invalidate the cache of %s\n", path);
+		return;
+	}
+	memcpy(inval->path, path, len);
+
+	pthread_mutex_lock(&inval_lock);
+	if (!inval_started) {
+		inval_fuse = fuse_get_context()->fuse;
+		inval_started = !pthread_create(&inval_thread, NULL, drain_invalidations, NULL);
+	}
+	if (inval_started) {
+		inval->next = pending_invals;
+		pending_invals = inval;
+		pthread_cond_signal(&inval_cond);
+	} else {
+		log_error("fisopfs: can't invalidate the cache of %s\n", path);
+		free(inval);
+	}
+	pthread_mutex_unlock(&inval_lock);
+}
+
+// stop_invalidations();
+// Sends the pending invalidations and stops the helper thread
+
+void
+stop_invalidations()
+{
+	if (!inval_started)
+		return;
+
+	pthread_mutex_lock(&inval_lock);
+	inval_stop = 1;
+	pthread_cond_signal(&inval_cond);
+	pthread_mutex_unlock(&inval_lock);
+
+	pthread_join(inval_thread, NULL);
+	inval_started = inval_stop = 0;
+}
 
 int
 check_read_permissions(struct inode *inode)
 {
-	struct fuse_context *context = fuse_get_context();
+	uid_t uid = caller_uid();
 	int access;
-	if (context->uid == inode->st_uid) {
+	if (uid == inode->st_uid) {
 		access = inode->st_mode & S_IRUSR;
-	} else if (context->uid == inode->st_gid) {
+	} else if (uid == inode->st_gid) {
 		access = inode->st_mode & S_IRGRP;
 	} else {
 		access = inode->st_mode & S_IROTH;
 	}
 
 	if (access == 0) {
-		printf("[debug] permission denied \n");
+		log_debug("[debug] permission denied \n");
 		return 0;
 	}
 
@@ -45,905 +409,3840 @@ check_read_permissions(struct inode *inode)
 int
 check_write_permissions(struct inode *inode)
 {
-	struct fuse_context *context = fuse_get_context();
+	uid_t uid = caller_uid();
 	int access;
-	if (context->uid == inode->st_uid) {
+	if (uid == inode->st_uid) {
 		access = inode->st_mode & S_IWUSR;
-	} else if (context->uid == inode->st_gid) {
+	} else if (uid == inode->st_gid) {
 		access = inode->st_mode & S_IWGRP;
 	} else {
 		access = inode->st_mode & S_IWOTH;
 	}
 	if (access == 0) {
-		printf("[debug] permission denied \n");
+		log_debug("[debug] permission denied \n");
 		return 0;
 	}
 
 	return 1;
 }
 
+// Slices of the inode and block tables each shard owns, see SHARD_START
+
 int
-get_name_index(const char *path)
+shard_inode(int k)
 {
-	int len = (int) strlen(path);
+	return SHARD_START(k, sb->n_shards, sb->n_inodes, N_INODES);
+}
 
-	int trunc = -1;
-	for (int c = len - 1; c >= 0;
-	     c--) {  // Iterate through path starting from end of string
-		if (path[c] == '/') {  // Look for '/'
-			trunc = c;     // Save index
-			break;
-		}
-	}
+int
+shard_block(int k)
+{
+	return SHARD_START(k, sb->n_shards, sb->n_blocks, N_BLOCKS);
+}
 
-	if (len == 0 || trunc == -1)  // If path is NULL or slash not found
-		return 0;             // Return 0. It may be a root dir file.
+int
+inode_shard(int d_ino)
+{
+	int k = sb->n_shards - 1;
 
-	if (trunc == 0)
-		trunc = 1;
+	while (k > 0 && d_ino < shard_inode(k))
+		k--;
 
-	return trunc + 1;
+	return k;
 }
 
+// init_inode(shard, mode);
+// Allocates an inode in the given shard, or in the next ones if it is full
+// return: inode number, -1 if there are no free inodes
+
 int
-init_inode(mode_t mode)
+init_inode(int shard, mode_t mode)
 {
-	for (int i = 0; i < N_INODES; i++) {
-		if (!bitmap_inodes->free_inodes[i]) {  // If inode is free
-			bitmap_inodes->free_inodes[i] =
-			        1;  // Set inode as occupied in bitmap
+	for (int n = 0; n < sb->n_shards; n++) {
+		int k = (shard + n) % sb->n_shards;
 
-			inodes[i].st_mode = mode;
-			inodes[i].st_nlink = 0;
-			inodes[i].st_uid = getuid();
-			inodes[i].st_gid = getgid();
-			inodes[i].st_size = 0;
-			inodes[i].st_blocks = 0;
+		for (int i = shard_inode(k); i < shard_inode(k + 1) && i < sb->n_inodes;
+		     i++) {
+			if (!bitmap_inodes->free_inodes[i]) {  // If inode is free
+				bitmap_inodes->free_inodes[i] =
+				        1;  // Set inode as occupied in bitmap
 
-			inodes[i].st_atime = inodes[i].st_mtime =
-			        inodes[i].st_ctime = time(NULL);
+				inodes[i].st_mode = mode;
+				inodes[i].st_nlink = 0;
+				inodes[i].st_uid = getuid();
+				inodes[i].st_gid = getgid();
+				inodes[i].st_size = 0;
+				inodes[i].st_blocks = 0;
 
-			inodes[i].ref = -1;
+				inodes[i].st_atime = inodes[i].st_mtime =
+				        inodes[i].st_ctime = fs_clock;
 
-			return i;
+				inodes[i].ref = -1;
+
+				return i;
+			}
 		}
 	}
 
-	printf("[debug] ran out of inodes\n");
+	log_debug("[debug] ran out of inodes\n");
 
 	return -1;
 }
 
+// The name arena is append only. Names are interned through name_index, an
+// open addressing hash table kept in memory, so equal names in different dirs
+// or snapshots take their bytes once. Space of removed names is reclaimed by
+// compacting the arena when it fills up, which moves every name.
+
+// name_ok(ref);
+// return: whether ref is a name inside the arena. Checked before reading a
+// name, as lookups also run inside seqlock read sections
+
 int
-init_file(const char *path, mode_t mode)
+name_ok(struct name_ref ref)
 {
-	path++;
-	int i = init_inode(mode);
+	return ref.len > 0 && ref.len <= NAME_MAX_LEN && ref.off >= 0 &&
+	       ref.off <= NAME_ARENA_SIZE - ref.len;
+}
 
-	if (i > -1) {
-		struct file new_file;  // Initialize new file
-		new_file.d_ino = i;
-		strcpy(new_file.path, path);
-		strcpy(new_file.filename, path + get_name_index(path));
-		printf("[debug] Filename: %s \n", new_file.filename);
-		files[sb->n_files] = new_file;  // Save file in array
+int
+name_eq(struct name_ref ref, const char *name, int len)
+{
+	return ref.len == len && name_ok(ref) &&
+	       memcmp(names->data + ref.off, name, len) == 0;
+}
 
-		return sb->n_files++;
-	}
+unsigned
+name_hash(const char *name, int len)
+{
+	unsigned hash = 2166136261u;  // FNV-1a
 
-	return -1;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+
+	return hash;
 }
 
-int
-init_block()
+// name_slot(name, len);
+// return: index entry of the name, or the empty one where it would go. NULL
+// if the index is full, then the name is just not shared
+
+struct name_ref *
+name_slot(const char *name, int len)
 {
-	for (int i = 0; i < N_BLOCKS; i++) {
-		if (!bitmap_blocks->free_blocks[i]) {
-			bitmap_blocks->free_blocks[i] =
-			        1;  // Set block as occupied
-			blocks[i].free_space = BLOCK_SIZE;
-			strcpy(blocks[i].content, "");
-			blocks[i].ref = -1;
-			return i;
-		}
+	unsigned slot = name_hash(name, len) % NAME_INDEX_SIZE;
+
+	for (int probe = 0; probe < NAME_INDEX_SIZE; probe++) {
+		struct name_ref *entry = &name_index[(slot + probe) % NAME_INDEX_SIZE];
+
+		if (entry->len == 0 || name_eq(*entry, name, len))
+			return entry;
 	}
 
-	return -1;
+	return NULL;
 }
 
-// get_dir(path);
-// recv: abs path to new file
-// return: dir where file is being created
+// store_name(name, len);
+// return: ref to the name in the arena, len is 0 if it doesn't fit
 
-struct dirent *
-get_dir(const char *path)
-{
-	int len = (int) strlen(path);
-	int slashs = 0;
-	int first_slash = 0;
-	for (int c = len - 1; c >= 0; c--) {  // Search through path for '/'
-		if (path[c] == '/') {
-			if (slashs == 0) {  // Save first slash
-				first_slash = c;
-				printf("[debug] First slash found on: "
-				       "path[%d]\n",
-				       first_slash);
-			}
-			slashs++;  // Update number of slashes
-		}
-	}
+struct name_ref
+store_name(const char *name, int len)
+{
+	struct name_ref ref = { 0, 0 };
+	struct name_ref *slot = name_slot(name, len);
 
-	if (slashs == 0)
-		return NULL;  // Slash not found: dir not found
+	if (slot && slot->len)
+		return *slot;  // Already there
 
-	else if (slashs == 1)
-		return &dirs[0];  // One slash found (must be on path[0]) : dir = root
+	if (len > NAME_ARENA_SIZE - names->used)
+		return ref;
 
-	else {
-		char *aux;
-		aux = malloc(first_slash);
-		strncpy(aux,
-		        path + 1,
-		        first_slash - 1);  // Copy the calculated dir path
-
-		aux[first_slash - 1] = '\0';
-		aux = strtok(aux, "\uFFFD");
-		printf("[debug] Looking for directory: %s \n", aux);
-		printf("[debug] Strlen: %ld \n", strlen(aux));
-		for (int i = 0; i < sb->n_dirs; i++) {
-			printf("[debug] Comparing against: %s \n", dirs[i].path);
-			printf("[debug] Strlen: %ld \n", strlen(dirs[i].path));
-			if (strcmp(aux, dirs[i].path) == 0) {
-				free(aux);
-				return &dirs[i];
-			}
-		}
+	ref.off = names->used;
+	ref.len = len;
+	memcpy(names->data + ref.off, name, len);
+	names->used += len;
+
+	if (slot)
+		*slot = ref;
+
+	return ref;
+}
+
+void
+move_names(const struct name_arena *old,
+           struct file *files_table,
+           int n_files,
+           struct dirent *dirs_table,
+           int n_dirs)
+{
+	for (int i = 0; i < n_files && i < N_INODES; i++) {
+		struct name_ref *ref = &files_table[i].name;
+		if (ref->len && name_ok(*ref))
+			*ref = store_name(old->data + ref->off, ref->len);
+	}
+
+	for (int d = 1; d < n_dirs && d < N_INODES; d++) {
+		struct name_ref *ref = &dirs_table[d].name;
+		if (ref->len && name_ok(*ref))
+			*ref = store_name(old->data + ref->off, ref->len);
 	}
-	printf("[debug] Directory not found\n");
-	return NULL;
 }
 
-int
-add_file(const char *filename, mode_t mode)
+// compact_names();
+// Rebuilds the arena and its index with only the names the live tables and
+// the snapshots refer to. Also run on mount, as the index isn't persisted
+
+void
+compact_names()
 {
-	struct dirent *dir = get_dir(filename);
+	struct name_arena *old = malloc(sizeof(struct name_arena));
 
-	struct inode *inode = &inodes[dir->d_ino];
+	if (!old)
+		return;
 
-	if (!check_write_permissions(inode)) {
-		return 0;
-	}
+	memcpy(old, names, sizeof(struct name_arena));
+	names->used = 0;
+	memset(name_index, 0, NAME_INDEX_SIZE * sizeof(struct name_ref));
 
-	int n_file = init_file(filename, mode);
+	move_names(old, files, sb->n_files, dirs, sb->n_dirs);
+	for (int i = 0; i < N_SNAPSHOTS; i++)
+		if (snapshots[i].used)
+			move_names(old,
+			           snapshots[i].files,
+			           snapshots[i].sb.n_files,
+			           snapshots[i].dirs,
+			           snapshots[i].sb.n_dirs);
 
-	if (dir && (n_file >= 0))
-		dir->files[dir->n_files++] = n_file;
-	else {
-		printf("[debug] ERROR while creating file \n");
-		return 0;
-	}
+	log_debug("[debug] name arena compacted: %d bytes in use, %d before \n",
+	          names->used,
+	          old->used);
 
-	return 1;
+	free(old);
 }
 
-int
-get_file_index(const char *path)
+// add_name(name, len);
+// return: ref to the stored name, len is 0 if there is no room for it even
+// after compacting the arena
+
+struct name_ref
+add_name(const char *name, int len)
 {
-	path++;
+	struct name_ref ref = store_name(name, len);
 
-	for (int i = 0; i <= sb->n_files; i++)
-		if (strcmp(path, files[i].path) == 0)
-			return i;
+	if (ref.len == 0) {
+		compact_names();
+		ref = store_name(name, len);
+	}
 
-	return -1;
+	return ref;
 }
 
+// entry_shard(n_dir, name);
+// return: shard for a new entry in dir n_dir: that of its top-level dir, so a
+// whole subtree is kept together. Entries at the root are spread by name.
+
 int
-get_dir_index(const char *path)
+entry_shard(int n_dir, struct name_ref name)
 {
-	path++;
-
-	for (int i = 0; i <= sb->n_dirs; i++)
-		if (strcmp(path, dirs[i].path) == 0)
-			return i;
+	if (n_dir > 0)
+		return inode_shard(dirs[n_dir].d_ino);
 
-	return -1;
+	return name_hash(names->data + name.off, name.len) % sb->n_shards;
 }
 
 int
-is_dir(const char *path)
+init_file(int n_dir, struct name_ref name, mode_t mode)
 {
-	path++;
+	int slot = sb->n_files;
 
-	for (int i = 0; i <= N_INODES; i++) {  // Iterate through dirs
-		if (strcmp(path, dirs[i].path) ==
-		    0)  // Check if path equals to dir path
-			return 1;
+	for (int j = 0; j < sb->n_files; j++) {
+		if (files[j].name.len == 0) {  // Reuse a removed file's slot
+			slot = j;
+			break;
+		}
 	}
-	return 0;
+
+	if (slot >= N_INODES) {
+		log_debug("[debug] ran out of file slots\n");
+		return -1;
+	}
+
+	int i = init_inode(entry_shard(n_dir, name), mode);
+
+	if (i > -1) {
+		struct file new_file;  // Initialize new file
+		new_file.name = name;
+		new_file.parent = n_dir;
+		new_file.d_ino = i;
+		log_debug("[debug] Filename: %.*s \n", name.len, names->data + name.off);
+		files[slot] = new_file;  // Save file in array
+
+		if (slot == sb->n_files)
+			sb->n_files++;
+
+		return slot;
+	}
+
+	return -1;
+}
+
+void
+claim_block(int id_block)
+{
+	bitmap_blocks->free_blocks[id_block] = 1;  // Set block as occupied
+	block_fill[id_block] = 0;
+	block_next[id_block] = -1;
+	block_resv[id_block] = -1;
 }
 
+// find_free_run(from, to, want, owner, &len);
+// Looks for want free blocks in a row between from and to that aren't
+// reserved for another inode
+// return: start of the first such run, or of the longest one if there is
+// none that long, -1 if no block is available. len is set to its length
+
 int
-is_file(const char *path)
+find_free_run(int from, int to, int want, int owner, int *len)
 {
-	path++;
+	int best = -1;
+	int best_len = 0;
+	int start = -1;
+
+	for (int i = from; i <= to; i++) {
+		if (i < to && !bitmap_blocks->free_blocks[i] &&
+		    (block_resv[i] == -1 || block_resv[i] == owner)) {
+			if (start < 0)
+				start = i;
+			if (i - start + 1 >= want) {
+				*len = want;
+				return start;
+			}
+			continue;
+		}
 
-	for (int i = 0; i < sb->n_files; i++) {
-		if (strcmp(path, files[i].path) == 0)
-			return 1;
+		if (start >= 0 && i - start > best_len) {
+			best = start;
+			best_len = i - start;
+		}
+		start = -1;
 	}
 
-	return 0;
+	*len = best_len;
+	return best;
 }
 
-void
-load_file_system(FILE *file)
+// init_block(goal, owner, want);
+// Allocates a block for inode owner, which still needs want more blocks.
+// goal (the block after the end of its chain) is preferred, so the chain
+// stays contiguous. Otherwise a free run is reserved for the file to grow
+// into, in the shard of its inode if possible. Blocks reserved for other
+// files are used only as a last resort.
+// return: block id, -1 if there are no free blocks
+
+int
+init_block(int goal, int owner, int want)
 {
-	if (fread(sb, sizeof(struct superblock), 1, file) <= 0) {
-		printf("error reading loading file: %s", file_name);
+	if (goal >= 0 && goal < sb->n_blocks && !bitmap_blocks->free_blocks[goal] &&
+	    (block_resv[goal] == -1 || block_resv[goal] == owner)) {
+		claim_block(goal);
+		return goal;
 	}
-	if (fread(bitmap_inodes, sizeof(struct bmap_inodes), 1, file) <= 0) {
-		printf("error reading loading file: %s", file_name);
-	}
-	if (fread(bitmap_blocks, sizeof(struct bmap_blocks), 1, file) <= 0) {
-		printf("error reading loading file: %s", file_name);
-	};
-	if (fread(inodes, sizeof(struct inode), N_INODES, file) <= 0) {
-		printf("error reading loading file: %s", file_name);
-	}
-	if (fread(blocks, sizeof(struct block), N_BLOCKS, file) <= 0) {
-		printf("error reading loading file: %s", file_name);
-	}
-	if (fread(files, sizeof(struct file), N_INODES, file) <= 0) {
-		printf("error reading loading file: %s", file_name);
+
+	if (want < RESERVE_BLOCKS)
+		want = RESERVE_BLOCKS;
+
+	int k = inode_shard(owner);
+	int to = shard_block(k + 1) < sb->n_blocks ? shard_block(k + 1) : sb->n_blocks;
+	int len;
+	int run = find_free_run(shard_block(k), to, want, owner, &len);
+
+	if (run < 0 && sb->n_shards > 1)  // The shard is full
+		run = find_free_run(0, sb->n_blocks, want, owner, &len);
+
+	if (run >= 0) {
+		for (int i = run + 1; i < run + len; i++)
+			block_resv[i] = owner;  // Reserve the rest of the run
+		claim_block(run);
+		log_debug("[debug] reserved run of %d blocks at %d for inode %d\n",
+		          len,
+		          run,
+		          owner);
+		return run;
 	}
-	if (fread(dirs, sizeof(struct dirent), N_INODES, file) <= 0) {
-		printf("error reading loading file: %s", file_name);
+
+	for (int i = 0; i < sb->n_blocks; i++) {
+		if (!bitmap_blocks->free_blocks[i]) {
+			claim_block(i);
+			return i;
+		}
 	}
 
-	fclose(file);
+	return -1;
 }
 
-void *
-fisopfs_init(struct fuse_conn_info *conn)
+// drop_reservation(owner);
+// Returns the blocks reserved for an inode to the free pool. -1 drops all
+
+void
+drop_reservation(int owner)
 {
-	printf("[debug] fisopfs_init() \n");
+	for (int i = 0; i < N_BLOCKS; i++)
+		if (block_resv[i] >= 0 && (owner < 0 || block_resv[i] == owner))
+			block_resv[i] = -1;
+}
 
-	char a[MAX_FILE_NAME_SIZE];
-	printf("Enter a name of load system file , must finish .fisops or "
-	       "press enter for default file\n");
+// Image layout: superblock, bitmaps, inodes, block fill levels and chain
+// links, files, dirs, names and snapshots, followed by the block data region
+// at data_offset(), which is page aligned so it can be mmap'ed or read with
+// O_DIRECT. Every shard file has this layout, holding only its own slices.
 
-	if (fgets(a, MAX_FILE_NAME_SIZE, stdin) <= 0) {
-		printf("error when read stdin");
-	}
-	if (strstr(a, ".fisops") != 0) {
-		printf("contine fisops\n");
-		strcpy(file_name, a);
-		printf("file name = %s\n", file_name);
-	} else if (!strcmp(a, "\n") == 0) {
-		printf("el nombre debe contener .fisops\n");
-		exit(-1);
-	}
+long
+data_offset()
+{
+	return DATA_OFFSET;
+}
 
-	sb = calloc(1, sizeof(struct superblock));
-	bitmap_inodes = calloc(1, sizeof(struct bmap_inodes));
-	bitmap_blocks = calloc(1, sizeof(struct bmap_blocks));
-	inodes = calloc(N_INODES, sizeof(struct inode));
-	blocks = calloc(N_BLOCKS, sizeof(struct block));
-	files = calloc(N_INODES, sizeof(struct file));
-	dirs = calloc(N_INODES, sizeof(struct dirent));
+// Each shard file is loaded and saved by a thread of its own. A checksum of
+// its slices is kept so that on unmount only the shards that changed are
+// written back.
 
-	FILE *file = fopen(file_name, "r+");
-	if (file != NULL) {
-		load_file_system(file);
-		printf("loaded SuperBlock - magic: %d\n", sb->magic);
-		printf("loaded SuperBlock - ndirs: %d\n", sb->n_dirs);
-		printf("loaded SuperBlock - nfils:%d\n", sb->n_files);
-	} else {
-		sb->magic = SUPERBLOCK_MAGIC;
-		sb->n_dirs = 1;  // One dir: root
-		sb->n_files = 0;
+struct shard {
+	FILE *image;        // Backing file while tiered
+	unsigned long sum;  // Checksum of its slices when last loaded or saved
+	int synced;         // The file holds the slices that sum was taken of
+	int ret;            // Last load or save: -1 failed, 1 written, 0 skipped
+	pthread_t thread;
+};
 
-		struct dirent root;
+int n_shards = 1;  // Shards of a new image, set by the shards= option
+int n_blocks = N_BLOCKS;  // Geometry of a new image, set by blocks= and
+int n_inodes = N_INODES;  // inodes=, as fisopfs-tool mkfs does
+int persist = 1;  // Write the image back on unmount, cleared by nopersist
+int create = 1;   // A missing image is created, cleared by nocreate
+struct shard shards[MAX_SHARDS];
 
-		int i = init_inode(__S_IFDIR | 0775);
+// shard_path(k, path);
+// recv: path of MAX_FILE_NAME_SIZE + 12 bytes
+// Shard 0 is file_name itself, the others file_name.1, file_name.2, ...
 
-		if (i < 0) {
-			printf("[debug] error while initializing root dir \n");
-			exit(1);
+void
+shard_path(int k, char *path)
+{
+	if (k == 0)
+		snprintf(path, MAX_FILE_NAME_SIZE + 12, "%s", file_name);
+	else
+		snprintf(path, MAX_FILE_NAME_SIZE + 12, "%s.%d", file_name, k);
+}
+
+int
+block_shard(int id_block)
+{
+	int k = sb->n_shards - 1;
+
+	while (k > 0 && id_block < shard_block(k))
+		k--;
+
+	return k;
+}
+
+// In tiered mode (cache_blocks > 0) only the metadata is resident: blocks are
+// read from the data region of the image into a bounded cache on demand, and
+// dirty ones are written back when evicted or on unmount. Eviction follows
+// the CLOCK policy: the hand skips (and clears) recently used slots.
+
+int cache_blocks = 0;  // Slots of the block cache, 0 = every block resident
+char *cache_data;      // cache_blocks * BLOCK_SIZE bytes, page aligned
+int *cache_block;      // block held by each slot, -1 if empty
+unsigned char *cache_flags;
+int *block_slot;  // slot holding each block, -1 if not cached
+int cache_hand;
+int cache_last;  // Slot returned last, never evicted by the next miss
+long cache_hits, cache_misses, cache_writebacks;
+
+// cache_writeback(slot);
+// Writes a dirty slot to the image. On failure the slot stays dirty, as it
+// holds the only up to date copy of the block.
+// return: 0 on success, -EIO if the image could not be written
+
+int
+cache_writeback(int slot)
+{
+	if (!(cache_flags[slot] & CACHE_DIRTY))
+		return 0;
+
+	int id_block = cache_block[slot];
+	FILE *image = shards[block_shard(id_block)].image;
+	long pos = data_offset() + (long) id_block * BLOCK_SIZE;
+
+	if (fseek(image, pos, SEEK_SET) < 0 ||
+	    fwrite(cache_data + (size_t) slot * BLOCK_SIZE, BLOCK_SIZE, 1, image) != 1) {
+		log_error("fisopfs: error writing back block %d: %s\n",
+		          id_block,
+		          strerror(errno));
+		return -EIO;
+	}
+
+	cache_flags[slot] &= ~CACHE_DIRTY;
+	cache_writebacks++;
+
+	return 0;
+}
+
+// cache_evict();
+// Frees a slot, skipping the ones whose block can't be written back
+// return: the slot, or -EIO if no slot could be freed
+
+int
+cache_evict()
+{
+	for (int tries = 0; tries < 3 * cache_blocks; tries++) {  // Every slot,
+		int slot = cache_hand;  // after clearing the reference bits
+		cache_hand = (cache_hand + 1) % cache_blocks;
+
+		if (slot == cache_last)
+			continue;
+
+		if (cache_flags[slot] & CACHE_REF) {
+			cache_flags[slot] &= ~CACHE_REF;  // Second chance
+			continue;
+		}
+
+		if (cache_block[slot] >= 0) {
+			if (cache_writeback(slot) < 0)
+				continue;  // Keep the block, try another slot
+			block_slot[cache_block[slot]] = -1;
+			cache_block[slot] = -1;
+		}
+
+		return slot;
+	}
+
+	return -EIO;
+}
+
+// cache_load(id_block);
+// Brings a block into the cache. Bytes past its fill are zeroed, since the
+// image may hold stale data there from a block that was freed.
+// return: slot holding the block, or -EIO if it could not be read
+
+int
+cache_load(int id_block)
+{
+	int slot = cache_evict();
+
+	if (slot < 0)
+		return slot;
+
+	char *data = cache_data + (size_t) slot * BLOCK_SIZE;
+	int fill = block_fill[id_block];
+	FILE *image = shards[block_shard(id_block)].image;
+	long pos = data_offset() + (long) id_block * BLOCK_SIZE;
+
+	if (fill > 0 && (fseek(image, pos, SEEK_SET) < 0 ||
+	                 fread(data, fill, 1, image) != 1)) {
+		log_error("fisopfs: error reading block %d: %s\n",
+		          id_block,
+		          ferror(image) ? strerror(errno) : "short image");
+		clearerr(image);
+		return -EIO;  // The slot is left empty
+	}
+	memset(data + fill, 0, BLOCK_SIZE - fill);
+
+	cache_block[slot] = id_block;
+	cache_flags[slot] = 0;
+	block_slot[id_block] = slot;
+	cache_misses++;
+
+	return slot;
+}
+
+// block_content(id_block, write);
+// recv: write is set when the caller modifies the block
+// return: pointer to the block's BLOCK_SIZE bytes, valid until the next call
+// but one. NULL if a tiered block could not be brought into the cache
+
+char *
+block_content(int id_block, int write)
+{
+	if (!cache_blocks)
+		return block_data + (size_t) id_block * BLOCK_SIZE;
+
+	int slot = block_slot[id_block];
+
+	if (slot < 0)
+		slot = cache_load(id_block);
+	else
+		cache_hits++;
+
+	if (slot < 0)
+		return NULL;
+
+	cache_flags[slot] |= CACHE_REF | (write ? CACHE_DIRTY : 0);
+	cache_last = slot;
+
+	return cache_data + (size_t) slot * BLOCK_SIZE;
+}
+
+// clear_block(id_block);
+// Zeroes a freed block. A cached copy is just dropped: with a fill of 0 the
+// block is never read back from the image.
+
+void
+clear_block(int id_block)
+{
+	if (!cache_blocks) {
+		memset(block_data + (size_t) id_block * BLOCK_SIZE, 0, BLOCK_SIZE);
+		return;
+	}
+
+	int slot = block_slot[id_block];
+
+	if (slot >= 0) {
+		cache_block[slot] = -1;
+		cache_flags[slot] = 0;
+		block_slot[id_block] = -1;
+	}
+}
+
+// cache_flush();
+// return: 0, or -EIO if a dirty block could not be written back
+
+int
+cache_flush()
+{
+	int err = 0;
+
+	for (int slot = 0; slot < cache_blocks; slot++)
+		if (cache_block[slot] >= 0 && cache_writeback(slot) < 0)
+			err = -EIO;
+
+	return err;
+}
+
+// Blocks are reference counted so snapshots can share them with the live
+// filesystem. A block is only cleaned when its last reference is dropped.
+
+void
+get_block(int id_block)
+{
+	bitmap_blocks->free_blocks[id_block]++;
+}
+
+void
+put_block(int id_block)
+{
+	if (--bitmap_blocks->free_blocks[id_block] > 0)
+		return;  // Still referenced by another inode
+
+	bitmap_blocks->free_blocks[id_block] = 0;  // Free block bitmap index
+	clear_block(id_block);  // Clean datablock
+	block_fill[id_block] = 0;
+	block_next[id_block] = -1;
+}
+
+void
+share_blocks(struct inode *inode)
+{
+	int id_block = inode->ref;
+
+	for (int j = 0; j < inode->st_blocks && id_block >= 0; j++) {
+		get_block(id_block);
+		id_block = block_next[id_block];
+	}
+}
+
+// unshare_blocks(inode, n_blocks);
+// Copy-on-write: gives the inode a private copy of every block among the
+// first n_blocks of its chain that it still shares with a snapshot or a
+// clone, so they can be modified in place. Chains only share tails, so the
+// blocks past them can stay shared.
+// return: 0 on success, -ENOSPC if there are no blocks left for the copies
+
+int
+unshare_blocks(struct inode *inode, int n_blocks)
+{
+	int prev = -1;
+	int id_block = inode->ref;
+	int owner = inode - inodes;  // Only live inodes are written to
+
+	if (n_blocks > inode->st_blocks)
+		n_blocks = inode->st_blocks;
+
+	for (int j = 0; j < n_blocks && id_block >= 0; j++) {
+		if (bitmap_blocks->free_blocks[id_block] > 1) {
+			int copy = init_block(prev >= 0 ? prev + 1 : -1,
+			                      owner,
+			                      inode->st_blocks - j);
+
+			if (copy < 0) {
+				log_debug("[debug] no blocks left to copy "
+				          "block %d\n",
+				          id_block);
+				return -ENOSPC;
+			}
+
+			char *to = block_content(copy, 1);
+			char *from = to ? block_content(id_block, 0) : NULL;
+
+			if (!from) {
+				put_block(copy);  // Not linked yet
+				return -EIO;
+			}
+			memcpy(to, from, BLOCK_SIZE);
+			block_fill[copy] = block_fill[id_block];
+			block_next[copy] = block_next[id_block];
+			bitmap_blocks->free_blocks[id_block]--;
+
+			if (prev >= 0)
+				block_next[prev] = copy;
+			else
+				inode->ref = copy;
+
+			log_debug("[debug] copied shared block %d into %d\n",
+			          id_block,
+			          copy);
+			id_block = copy;
+		}
+
+		prev = id_block;
+		id_block = block_next[id_block];
+	}
+
+	return 0;
+}
+
+void
+flush_blocks(struct inode *inode)
+{
+	log_debug("[debug] flushing blocks from inode %p \n", inode);
+
+	int id_block = inode->ref;
+
+	for (int j = 0; j < inode->st_blocks; j++) {
+		log_debug("[debug] cleaning block %d of %ld\n",
+		          j + 1,
+		          inode->st_blocks);
+
+		int next = block_next[id_block];
+		put_block(id_block);  // Drop this inode's reference
+		id_block = next;
+	}
+	inode->st_blocks = 0;
+	inode->ref = -1;
+	inode->st_size = 0;
+}
+
+// File data is packed: block j of the chain holds the bytes starting at
+// j * BLOCK_SIZE, and every block but the last one in use is full. Blocks that
+// are adjacent in the chain and in block_data form a run, which is copied with
+// a single memcpy.
+
+// copy_run(first, n, from, buffer, len, write);
+// Copies len bytes between buffer and the run of n blocks starting at block
+// first, from byte from of the run. In tiered mode the run is only contiguous
+// in the image, so it goes through the cache one block at a time.
+// return: 0, or -EIO if a tiered block could not be read or made room for
+
+int
+copy_run(int first, int n, off_t from, char *buffer, size_t len, int write)
+{
+	if (!cache_blocks) {
+		char *data = block_data + (size_t) first * BLOCK_SIZE + from;
+		if (write)
+			memcpy(data, buffer, len);
+		else
+			memcpy(buffer, data, len);
+		return 0;
+	}
+
+	for (size_t done = 0; done < len;) {
+		int k = (from + done) / BLOCK_SIZE;
+		off_t in = (from + done) % BLOCK_SIZE;
+		size_t part = BLOCK_SIZE - in;
+
+		if (part > len - done)
+			part = len - done;
+
+		char *data = block_content(first + k, write);
+
+		if (!data)
+			return -EIO;
+		if (write)
+			memcpy(data + in, buffer + done, part);
+		else
+			memcpy(buffer + done, data + in, part);
+
+		done += part;
+	}
+
+	return 0;
+}
+
+// get_chain_block(inode, j);
+// return: id of the j-th block of the inode's chain, -1 if it has no such block
+
+int
+get_chain_block(struct inode *inode, int j)
+{
+	int id_block = inode->ref;
+
+	for (int k = 0; k < j && id_block >= 0; k++)
+		id_block = block_next[id_block];
+
+	return j < inode->st_blocks ? id_block : -1;
+}
+
+// copy_runs(inode, buffer, size, offset, write);
+// Copies between buffer and the file bytes [offset, offset + size), which
+// must be backed by blocks. Writing also updates the fill of the blocks.
+// return: number of bytes copied, or -EIO
+
+ssize_t
+copy_runs(struct inode *inode, char *buffer, size_t size, off_t offset, int write)
+{
+	int j = offset / BLOCK_SIZE;
+	int id_block = get_chain_block(inode, j);
+	size_t done = 0;
+
+	while (done < size && id_block >= 0) {
+		int first = id_block;
+		int n = 1;
+		off_t run_start = (off_t) j * BLOCK_SIZE;
+
+		while (block_next[id_block] == id_block + 1 &&
+		       run_start + (off_t) n * BLOCK_SIZE <
+		               offset + (off_t) size) {  // Extend the run
+			id_block++;
+			n++;
+		}
+
+		off_t from = offset + done - run_start;
+		size_t len = (size_t) n * BLOCK_SIZE - from;
+
+		if (len > size - done)
+			len = size - done;
+
+		log_debug("[debug] %s run of %d blocks from absolute block %d\n",
+		          write ? "writing" : "reading",
+		          n,
+		          first);
+
+		if (copy_run(first, n, from, buffer + done, len, write) < 0)
+			return -EIO;
+
+		if (write) {
+			for (int k = 0; k < n; k++) {  // Update fill levels
+				off_t end = from + len - (off_t) k * BLOCK_SIZE;
+				if (end > BLOCK_SIZE)
+					end = BLOCK_SIZE;
+				if (end > block_fill[first + k])
+					block_fill[first + k] = end;
+			}
+		}
+
+		done += len;
+		j += n;
+		id_block = block_next[id_block];
+	}
+
+	return done;
+}
+
+// read_content(inode, buffer, size, offset);
+// Copies up to size bytes of the inode's data starting at offset.
+// return: number of bytes read (0 at end of file)
+
+int
+read_content(struct inode *inode, char *buffer, size_t size, off_t offset)
+{
+	log_debug("[debug] reading content from %ld blocks \n", inode->st_blocks);
+
+	if (offset >= inode->st_size)
+		return 0;
+
+	if (size > inode->st_size - offset)
+		size = inode->st_size - offset;
+
+	ssize_t len = copy_runs(inode, buffer, size, offset, 0);
+
+	log_debug("[debug] len : %ld \n", len);
+
+	return (int) len;
+}
+
+// alloc_blocks(inode, n_blocks);
+// Appends empty blocks to the inode's chain until it has n_blocks
+// return: number of blocks in the chain, which may be less if space ran out
+
+int
+alloc_blocks(struct inode *inode, int n_blocks)
+{
+	int last = get_chain_block(inode, inode->st_blocks - 1);
+	int owner = inode - inodes;  // Only live inodes are written to
+
+	if (n_blocks > N_BLOCKS_INODE)
+		n_blocks = N_BLOCKS_INODE;
+
+	while (inode->st_blocks < n_blocks) {
+		int want = n_blocks - inode->st_blocks;
+
+		if (want < inode->st_blocks)  // The window grows with the file
+			want = inode->st_blocks;
+
+		int id_block = init_block(last >= 0 ? last + 1 : -1, owner, want);
+
+		if (id_block < 0) {
+			log_debug("[debug] Inode %p can't initialize more blocks\n",
+			          inode);
+			break;
+		}
+
+		if (last >= 0)
+			block_next[last] = id_block;
+		else
+			inode->ref = id_block;
+
+		last = id_block;
+		inode->st_blocks++;
+		log_debug("[debug] Initialize block n: %d \n", id_block);
+		log_debug("[debug] Inode %p now has %ld blocks assigned\n",
+		          inode,
+		          inode->st_blocks);
+	}
+
+	return inode->st_blocks;
+}
+
+// write_content(inode, buffer, size, offset);
+// Writes size bytes at offset, overwriting existing data and growing the
+// file as needed. A gap between the end of the file and offset is zeroed.
+// return: number of bytes written, less than size if the file is full
+
+int
+write_content(struct inode *inode, const char *buffer, size_t size, off_t offset)
+{
+	off_t end = offset + size;
+	int n_blocks = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	off_t capacity = (off_t) alloc_blocks(inode, n_blocks) * BLOCK_SIZE;
+
+	if (end > capacity)
+		end = capacity;
+
+	if (offset >= end)
+		return 0;
+
+	if (offset > inode->st_size) {  // Fill the hole with zeros
+		size_t gap = offset - inode->st_size;
+		char *zeros = calloc(1, gap);
+		if (!zeros)
+			return -ENOMEM;
+		ssize_t zeroed = copy_runs(inode, zeros, gap, inode->st_size, 1);
+		free(zeros);
+		if (zeroed < 0)
+			return (int) zeroed;
+	}
+
+	ssize_t written = copy_runs(inode, (char *) buffer, end - offset, offset, 1);
+
+	if (written < 0)
+		return (int) written;
+
+	if (offset + (off_t) written > inode->st_size)
+		inode->st_size = offset + written;
+
+	return (int) written;
+}
+
+// clone_range(dst, dst_off, src, src_off, len);
+// Reflink: links the tail of src's chain from src_off on into dst's chain at
+// dst_off, taking a reference on every shared block, and releases the blocks
+// dst had from there. Chains can only share a tail, so both offsets must
+// start a block and the range must run to the end of src and cover the end
+// of dst. Later writes to either file copy the blocks (unshare_blocks).
+// return: bytes cloned, 0 if the range can't be shared, -ENOSPC
+
+off_t
+clone_range(struct inode *dst, off_t dst_off, struct inode *src, off_t src_off, size_t len)
+{
+	int keep = dst_off / BLOCK_SIZE;
+	int skip = src_off / BLOCK_SIZE;
+	off_t n = src->st_size - src_off;
+
+	if (dst == src || dst_off % BLOCK_SIZE || src_off % BLOCK_SIZE)
+		return 0;
+
+	if (n <= 0 || (off_t) len < n || dst_off > dst->st_size ||
+	    dst_off + n < dst->st_size)
+		return 0;
+
+	if (keep + src->st_blocks - skip > N_BLOCKS_INODE)
+		return 0;
+
+	int err = unshare_blocks(dst, keep);  // The last kept block will point
+	if (err < 0)                          // into src's chain
+		return err;
+
+	int id_block = get_chain_block(dst, keep);
+
+	for (int j = keep; j < dst->st_blocks; j++) {
+		int next = block_next[id_block];
+		put_block(id_block);
+		id_block = next;
+	}
+
+	int first = get_chain_block(src, skip);
+
+	if (keep > 0)
+		block_next[get_chain_block(dst, keep - 1)] = first;
+	else
+		dst->ref = first;
+
+	dst->st_blocks = keep + src->st_blocks - skip;
+	dst->st_size = dst_off + n;
+
+	for (int j = keep; j < dst->st_blocks; j++) {
+		get_block(first);
+		first = block_next[first];
+	}
+
+	log_debug("[debug] cloned %ld bytes from block %d of inode %p\n",
+	          n,
+	          skip,
+	          src);
+
+	return n;
+}
+
+// Write buffers absorb small writes at the end of a file, so log-style
+// writers walk the blocks once per WRITE_BUFFER_SIZE bytes instead of once
+// per write. Every file opened for writing gets one, and at most one of them
+// holds uncommitted data for a given inode at a time.
+
+struct write_buffer *write_buffers;      // All open write buffers
+struct write_buffer *pending[N_INODES];  // Buffer with uncommitted data
+size_t pending_len[N_INODES];  // Its length, for lock-free readers
+
+struct write_buffer *
+get_write_buffer(struct fuse_file_info *fi)
+{
+	return fi ? (struct write_buffer *) (uintptr_t) fi->fh : NULL;
+}
+
+struct write_buffer *
+open_write_buffer(int d_ino)
+{
+	struct write_buffer *wb = calloc(1, sizeof(struct write_buffer));
+
+	if (wb) {
+		wb->d_ino = d_ino;
+		wb->next = write_buffers;
+		write_buffers = wb;
+	}
+
+	return wb;
+}
+
+void
+drop_pending(int d_ino)
+{
+	if (pending[d_ino]) {
+		pending[d_ino]->len = 0;
+		pending[d_ino] = NULL;
+		pending_len[d_ino] = 0;
+	}
+}
+
+// commit_write_buffer(wb);
+// Appends the buffered data to the file's blocks
+// return: 0 on success, -ENOSPC if the data didn't fit
+
+int
+commit_write_buffer(struct write_buffer *wb)
+{
+	if (wb->d_ino < 0 || wb->len == 0)
+		return 0;
+
+	struct inode *inode = &inodes[wb->d_ino];
+	size_t len = wb->len;
+
+	drop_pending(wb->d_ino);
+	log_debug("[debug] committing %ld buffered bytes to inode %d \n",
+	          len,
+	          wb->d_ino);
+
+	int err = unshare_blocks(inode, inode->st_blocks);  // Copy-on-write
+	if (err < 0)
+		return err;
+
+	touch_mtime(inode);
+	fs_dirty = 1;
+
+	int written = write_content(inode, wb->data, len, inode->st_size);
+	if (written < 0)
+		return written;
+	if (written < (int) len)
+		return -ENOSPC;
+
+	return 0;
+}
+
+int
+commit_pending(int d_ino)
+{
+	return pending[d_ino] ? commit_write_buffer(pending[d_ino]) : 0;
+}
+
+void
+commit_write_buffers()
+{
+	for (struct write_buffer *wb = write_buffers; wb; wb = wb->next)
+		commit_write_buffer(wb);
+}
+
+// detach_write_buffers(d_ino);
+// Drops the buffered data of an inode that is being removed or replaced.
+// Its buffers fall back to unbuffered writes. -1 detaches every buffer.
+
+void
+detach_write_buffers(int d_ino)
+{
+	for (struct write_buffer *wb = write_buffers; wb; wb = wb->next) {
+		if (wb->d_ino >= 0 && (d_ino < 0 || wb->d_ino == d_ino)) {
+			drop_pending(wb->d_ino);
+			wb->d_ino = -1;
+		}
+	}
+}
+
+int
+close_write_buffer(struct write_buffer *wb)
+{
+	struct write_buffer **prev = &write_buffers;
+	int err = commit_write_buffer(wb);
+
+	while (*prev && *prev != wb)
+		prev = &(*prev)->next;
+	if (*prev)
+		*prev = wb->next;
+
+	free(wb);
+
+	return err;
+}
+
+// buffer_write(wb, buffer, size, offset);
+// return: bytes buffered, 0 if the write must go unbuffered (it is large,
+// not an append, or doesn't fit in the file), or -errno from a commit
+
+int
+buffer_write(struct write_buffer *wb,
+             const char *buffer,
+             size_t size,
+             off_t offset)
+{
+	if (wb->d_ino < 0 || size >= WRITE_BUFFER_SIZE)
+		return 0;
+
+	struct inode *inode = &inodes[wb->d_ino];
+	int err;
+
+	if (pending[wb->d_ino] && pending[wb->d_ino] != wb &&
+	    (err = commit_write_buffer(pending[wb->d_ino])) < 0)
+		return err;
+
+	if (offset != inode->st_size + wb->len ||
+	    offset + size > N_BLOCKS_INODE * BLOCK_SIZE) {
+		err = commit_write_buffer(wb);
+		return err < 0 ? err : 0;
+	}
+
+	if (wb->len + size > WRITE_BUFFER_SIZE &&
+	    (err = commit_write_buffer(wb)) < 0)
+		return err;
+
+	memcpy(wb->data + wb->len, buffer, size);
+	wb->len += size;
+	pending[wb->d_ino] = wb;
+	pending_len[wb->d_ino] = wb->len;
+
+	if (wb->len == WRITE_BUFFER_SIZE && (err = commit_write_buffer(wb)) < 0)
+		return err;
+
+	return (int) size;
+}
+
+// Lookups also run inside seqlock read sections, so they compare names with
+// a bound and never index past the tables. They take the tables to search,
+// which are either the live ones or those frozen in a snapshot.
+
+int
+find_dir(struct dirent *dirs_table, int n_dirs, int parent, const char *name, int len)
+{
+	for (int d = 1; d < n_dirs && d < N_INODES; d++)
+		if (dirs_table[d].parent == parent && name_eq(dirs_table[d].name, name, len))
+			return d;
+
+	return -1;
+}
+
+int
+find_file(struct file *files_table, int n_files, int parent, const char *name, int len)
+{
+	for (int i = 0; i < n_files && i < N_INODES; i++)
+		if (files_table[i].parent == parent &&
+		    name_eq(files_table[i].name, name, len))
+			return i;
+
+	return -1;
+}
+
+// walk_path(dirs_table, n_dirs, path, &name);
+// Resolves every component of an absolute path but the last one
+// return: index of the dir the last component is in, or -1 if some dir on the
+// way doesn't exist. name is set to the last component
+
+int
+walk_path(struct dirent *dirs_table, int n_dirs, const char *path, const char **name)
+{
+	const char *end;
+	int n_dir = 0;
+
+	path++;  // Skip the root's '/'
+
+	while ((end = strchr(path, '/'))) {
+		n_dir = find_dir(dirs_table, n_dirs, n_dir, path, end - path);
+		if (n_dir < 0)
+			return -1;
+		path = end + 1;
+	}
+
+	*name = path;
+
+	return n_dir;
+}
+
+int
+add_file(const char *path, mode_t mode)
+{
+	const char *name;
+	int n_dir = walk_path(dirs, sb->n_dirs, path, &name);
+
+	if (n_dir < 0)
+		return -ENOENT;
+
+	struct inode *inode = &inodes[dirs[n_dir].d_ino];
+
+	if (!check_write_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	struct name_ref ref = add_name(name, strlen(name));
+
+	if (ref.len == 0) {
+		log_debug("[debug] no room left for the name %s \n", name);
+		return -ENOSPC;
+	}
+
+	if (init_file(n_dir, ref, mode) < 0) {
+		log_debug("[debug] ERROR while creating file \n");
+		return PERMISSION_DENIED;
+	}
+
+	return 0;
+}
+
+int
+get_file_index(const char *path)
+{
+	const char *name;
+	int n_dir = walk_path(dirs, sb->n_dirs, path, &name);
+
+	if (n_dir < 0)
+		return -1;
+
+	return find_file(files, sb->n_files, n_dir, name, strlen(name));
+}
+
+int
+get_dir_index(const char *path)
+{
+	if (strcmp(path, "/") == 0)
+		return 0;
+
+	const char *name;
+	int n_dir = walk_path(dirs, sb->n_dirs, path, &name);
+
+	if (n_dir < 0)
+		return -1;
+
+	return find_dir(dirs, sb->n_dirs, n_dir, name, strlen(name));
+}
+
+int
+is_dir(const char *path)
+{
+	return get_dir_index(path) >= 0;
+}
+
+int
+is_file(const char *path)
+{
+	return get_file_index(path) >= 0;
+}
+
+// fill_stat(inode, is_file, read_only, st);
+// Fills the attributes getattr reports for an inode. Inodes frozen in a
+// snapshot are reported read-only.
+
+void
+fill_stat(struct inode *inode, int is_file, int read_only, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+
+	st->st_mode = inode->st_mode;
+	if (read_only)
+		st->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	st->st_nlink = is_file ? 1 : 3;
+	st->st_size = is_file ? inode->st_size : 0;
+	st->st_gid = inode->st_gid;
+	st->st_uid = inode->st_uid;
+	st->st_atime = inode->st_atime;
+	st->st_mtime = inode->st_mtime;
+	st->st_ctime = inode->st_ctime;
+	st->st_blocks = inode->st_blocks;
+}
+
+// Snapshots are browsable read-only under /.snapshots/<name>. Paths inside
+// them are resolved against the frozen tables of the snapshot, while the data
+// blocks are the same ones the live filesystem (or other snapshots) use.
+
+int
+is_snapshot_path(const char *path)
+{
+	size_t len = strlen("/" SNAPSHOT_DIR);
+
+	return strncmp(path, "/" SNAPSHOT_DIR, len) == 0 &&
+	       (path[len] == '\0' || path[len] == '/');
+}
+
+// snapshot_name(path);
+// return: name of the snapshot if path is exactly /.snapshots/<name>, or NULL
+
+const char *
+snapshot_name(const char *path)
+{
+	const char *name = path + strlen("/" SNAPSHOT_DIR);
+
+	if (!is_snapshot_path(path) || *name != '/')
+		return NULL;
+
+	name++;
+	if (*name == '\0' || strchr(name, '/'))
+		return NULL;
+
+	return name;
+}
+
+// get_snapshot(path, &rest);
+// recv: abs path inside /.snapshots
+// return: snapshot the path belongs to, or NULL. rest is set to the path
+// inside the snapshot ("/" for its root dir)
+
+struct snapshot *
+get_snapshot(const char *path, const char **rest)
+{
+	const char *name = path + strlen("/" SNAPSHOT_DIR);
+
+	if (!is_snapshot_path(path) || *name != '/')
+		return NULL;
+
+	name++;
+	const char *end = strchr(name, '/');
+	size_t len = end ? (size_t) (end - name) : strlen(name);
+
+	if (len >= FS_FILENAME_LEN)
+		return NULL;
+
+	for (int i = 0; i < N_SNAPSHOTS; i++) {
+		struct snapshot *snap = &snapshots[i];
+		if (snap->used && strncmp(snap->name, name, len) == 0 &&
+		    snap->name[len] == '\0') {
+			*rest = end ? end : "/";
+			return snap;
+		}
+	}
+
+	return NULL;
+}
+
+struct dirent *
+snapshot_get_dir(struct snapshot *snap, const char *path)
+{
+	if (strcmp(path, "/") == 0)
+		return &snap->dirs[0];
+
+	const char *name;
+	int n_dir = walk_path(snap->dirs, snap->sb.n_dirs, path, &name);
+
+	if (n_dir < 0 ||
+	    (n_dir = find_dir(snap->dirs, snap->sb.n_dirs, n_dir, name, strlen(name))) < 0)
+		return NULL;
+
+	return &snap->dirs[n_dir];
+}
+
+struct file *
+snapshot_get_file(struct snapshot *snap, const char *path)
+{
+	const char *name;
+	int n_dir = walk_path(snap->dirs, snap->sb.n_dirs, path, &name);
+	int i;
+
+	if (n_dir < 0 ||
+	    (i = find_file(snap->files, snap->sb.n_files, n_dir, name, strlen(name))) < 0)
+		return NULL;
+
+	return &snap->files[i];
+}
+
+int
+snapshot_create(const char *name)
+{
+	struct snapshot *snap = NULL;
+
+	if (strlen(name) >= FS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	for (int i = 0; i < N_SNAPSHOTS; i++) {
+		if (snapshots[i].used && strcmp(snapshots[i].name, name) == 0)
+			return -EEXIST;
+		if (!snapshots[i].used && !snap)
+			snap = &snapshots[i];
+	}
+
+	if (!snap) {
+		log_debug("[debug] ran out of snapshots\n");
+		return -ENOSPC;
+	}
+
+	commit_write_buffers();  // The snapshot includes buffered writes
+
+	snap->used = 1;
+	strcpy(snap->name, name);
+	snap->created = fs_clock;
+	snap->sb = *sb;
+	snap->bitmap_inodes = *bitmap_inodes;
+	memcpy(snap->inodes, inodes, sizeof(struct inode) * N_INODES);
+	memcpy(snap->files, files, sizeof(struct file) * N_INODES);
+	memcpy(snap->dirs, dirs, sizeof(struct dirent) * N_INODES);
+
+	for (int i = 0; i < N_INODES; i++)  // Data is shared, not copied
+		if (bitmap_inodes->free_inodes[i])
+			share_blocks(&inodes[i]);
+
+	log_debug("[debug] created snapshot %s \n", name);
+
+	return 0;
+}
+
+void
+snapshot_delete(struct snapshot *snap)
+{
+	for (int i = 0; i < N_INODES; i++)
+		if (snap->bitmap_inodes.free_inodes[i])
+			flush_blocks(&snap->inodes[i]);
+
+	log_debug("[debug] deleted snapshot %s \n", snap->name);
+	memset(snap, 0, sizeof(struct snapshot));
+}
+
+// snapshot_rollback(snap);
+// Replaces the live filesystem with the contents of the snapshot. The
+// snapshot is kept, so it can be rolled back to again.
+
+void
+snapshot_rollback(struct snapshot *snap)
+{
+	detach_write_buffers(-1);
+	drop_reservation(-1);
+
+	for (int i = 0; i < N_INODES; i++)
+		if (bitmap_inodes->free_inodes[i])
+			flush_blocks(&inodes[i]);
+
+	*sb = snap->sb;
+	*bitmap_inodes = snap->bitmap_inodes;
+	memcpy(inodes, snap->inodes, sizeof(struct inode) * N_INODES);
+	memcpy(files, snap->files, sizeof(struct file) * N_INODES);
+	memcpy(dirs, snap->dirs, sizeof(struct dirent) * N_INODES);
+
+	for (int i = 0; i < N_INODES; i++)
+		if (bitmap_inodes->free_inodes[i])
+			share_blocks(&inodes[i]);
+
+	log_debug("[debug] rolled back to snapshot %s \n", snap->name);
+}
+
+int
+snapshot_getattr(const char *path, struct stat *st)
+{
+	const char *rest;
+	struct snapshot *snap = get_snapshot(path, &rest);
+	struct inode *inode;
+	struct file *file = NULL;
+
+	if (snap) {
+		struct dirent *dir = snapshot_get_dir(snap, rest);
+		int d_ino;
+
+		if (dir) {
+			d_ino = dir->d_ino;
+		} else if ((file = snapshot_get_file(snap, rest))) {
+			d_ino = file->d_ino;
+		} else {
+			return -ENOENT;
+		}
+
+		if (d_ino < 0 || d_ino >= N_INODES)
+			return -ENOENT;
+		inode = &snap->inodes[d_ino];
+	} else if (strcmp(path, "/" SNAPSHOT_DIR) == 0) {
+		inode = &inodes[dirs[0].d_ino];  // Same owner and times as root
+	} else {
+		return -ENOENT;
+	}
+
+	fill_stat(inode, file != NULL, 1, st);
+	st->st_ino = inode - (snap ? snap->inodes : inodes);  // As in readdir
+
+	return 0;
+}
+
+int
+snapshot_read(const char *path, char *buffer, size_t size, off_t offset)
+{
+	const char *rest;
+	struct snapshot *snap = get_snapshot(path, &rest);
+	struct file *file = snap ? snapshot_get_file(snap, rest) : NULL;
+
+	if (!file)
+		return -ENOENT;
+
+	struct inode *inode = &snap->inodes[file->d_ino];
+
+	if (!check_read_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	return read_content(inode, buffer, size, offset);
+}
+
+// The slices of the tables a shard holds, with where they go in its file
+
+struct slice {
+	long off;
+	void *data;
+	size_t size;
+};
+
+#define MAX_SLICES 10
+
+// shard_slices(k, slices);
+// recv: slices with room for MAX_SLICES
+// return: number of slices shard k holds. The data region is one of them
+// unless tiered, where blocks are read and written through the cache.
+
+int
+shard_slices(int k, struct slice *slices)
+{
+	int i0 = shard_inode(k), i1 = shard_inode(k + 1);
+	int b0 = shard_block(k), b1 = shard_block(k + 1);
+	int n = 0;
+
+	slices[n++] = (struct slice){ OFF_BITMAP_INODES + (long) sizeof(int) * i0,
+		                      &bitmap_inodes->free_inodes[i0],
+		                      sizeof(int) * (i1 - i0) };
+	slices[n++] = (struct slice){ OFF_BITMAP_BLOCKS + (long) sizeof(int) * b0,
+		                      &bitmap_blocks->free_blocks[b0],
+		                      sizeof(int) * (b1 - b0) };
+	slices[n++] = (struct slice){ OFF_INODES + (long) sizeof(struct inode) * i0,
+		                      &inodes[i0],
+		                      sizeof(struct inode) * (i1 - i0) };
+	slices[n++] = (struct slice){ OFF_BLOCK_FILL + (long) sizeof(int) * b0,
+		                      &block_fill[b0],
+		                      sizeof(int) * (b1 - b0) };
+	slices[n++] = (struct slice){ OFF_BLOCK_NEXT + (long) sizeof(int) * b0,
+		                      &block_next[b0],
+		                      sizeof(int) * (b1 - b0) };
+
+	if (k == 0) {  // The namespace is not split
+		slices[n++] = (struct slice){ OFF_FILES,
+			                      files,
+			                      sizeof(struct file) * N_INODES };
+		slices[n++] = (struct slice){ OFF_DIRS,
+			                      dirs,
+			                      sizeof(struct dirent) * N_INODES };
+		slices[n++] = (struct slice){ OFF_NAMES,
+			                      names,
+			                      sizeof(struct name_arena) };
+		slices[n++] = (struct slice){ OFF_SNAPSHOTS,
+			                      snapshots,
+			                      sizeof(struct snapshot) * N_SNAPSHOTS };
+	}
+
+	if (!cache_blocks)
+		slices[n++] = (struct slice){ data_offset() + (long) BLOCK_SIZE * b0,
+			                      block_data + (size_t) BLOCK_SIZE * b0,
+			                      (size_t) BLOCK_SIZE * (b1 - b0) };
+
+	return n;
+}
+
+// shard_checksum(k);
+// return: FNV-1a hash of the slices shard k holds
+
+unsigned long
+shard_checksum(int k)
+{
+	struct slice slices[MAX_SLICES];
+	int n = shard_slices(k, slices);
+	unsigned long sum = 14695981039346656037ul;
+
+	for (int i = 0; i < n; i++) {
+		const unsigned char *p = slices[i].data;
+
+		for (size_t j = 0; j < slices[i].size; j++)
+			sum = (sum ^ p[j]) * 1099511628211ul;
+	}
+
+	return sum;
+}
+
+// shard_io(k, file, write);
+// Reads shard k's slices from file, or writes them to it. Every shard file
+// starts with a copy of the superblock, checked on read so that shards of
+// different images are not mixed.
+// return: 0 on success, -1 on error
+
+int
+shard_io(int k, FILE *file, int write)
+{
+	struct slice slices[MAX_SLICES];
+	int n = shard_slices(k, slices);
+	struct superblock copy;
+
+	if (fseek(file, 0, SEEK_SET) < 0)
+		return -1;
+
+	if (write) {
+		if (fwrite(sb, sizeof(struct superblock), 1, file) != 1)
+			return -1;
+	} else if (fread(&copy, sizeof(struct superblock), 1, file) != 1 ||
+	           copy.magic != sb->magic || copy.n_shards != sb->n_shards ||
+	           copy.n_blocks != sb->n_blocks || copy.n_inodes != sb->n_inodes) {
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (slices[i].size == 0)
+			continue;
+
+		if (fseek(file, slices[i].off, SEEK_SET) < 0)
+			return -1;
+
+		if (write ? fwrite(slices[i].data, slices[i].size, 1, file) != 1
+		          : fread(slices[i].data, slices[i].size, 1, file) != 1)
+			return -1;
+	}
+
+	return 0;
+}
+
+void *
+load_shard(void *arg)
+{
+	struct shard *shard = arg;
+	int k = shard - shards;
+	char path[MAX_FILE_NAME_SIZE + 12];
+
+	shard_path(k, path);
+	FILE *file = fopen(path, persist ? "r+" : "r");
+
+	shard->ret = file ? shard_io(k, file, 0) : -1;
+	if (shard->ret < 0) {
+		log_error("error reading loading file: %s\n", path);
+		if (file)
+			fclose(file);
+		return NULL;
+	}
+
+	if (!cache_blocks)  // Free space may hold stale data
+		for (int i = shard_block(k); i < shard_block(k + 1); i++)
+			if (block_fill[i] >= 0 && block_fill[i] < BLOCK_SIZE)
+				memset(block_data + (size_t) i * BLOCK_SIZE +
+				               block_fill[i],
+				       0,
+				       BLOCK_SIZE - block_fill[i]);
+
+	shard->sum = shard_checksum(k);
+	shard->synced = 1;
+
+	if (cache_blocks)
+		shard->image = file;  // Blocks are read on demand
+	else
+		fclose(file);
+
+	return NULL;
+}
+
+// load_file_system();
+// Reads the superblock from the first shard, then the shards in parallel
+// return: 0 on success, -1 if some shard could not be read
+
+int
+load_file_system()
+{
+	FILE *file = fopen(file_name, "r");
+
+	if (!file || fread(sb, sizeof(struct superblock), 1, file) != 1) {
+		log_error("error reading loading file: %s\n", file_name);
+		if (file)
+			fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	log_info("loaded SuperBlock - magic: %d\n", sb->magic);
+	log_info("loaded SuperBlock - ndirs: %d\n", sb->n_dirs);
+	log_info("loaded SuperBlock - nfils:%d\n", sb->n_files);
+
+	if (sb->magic != SUPERBLOCK_MAGIC) {
+		log_error("%s is not a file system image of this "
+		          "version\n",
+		          file_name);
+		exit(1);
+	}
+
+	if (sb->n_blocks <= 0 || sb->n_blocks > N_BLOCKS || sb->n_inodes <= 0 ||
+	    sb->n_inodes > N_INODES || sb->n_shards <= 0 ||
+	    sb->n_shards > MAX_SHARDS) {
+		log_error("%s has a geometry this build does not support, "
+		          "run fisopfs-tool fsck\n",
+		          file_name);
+		exit(1);
+	}
+
+	if (n_shards != sb->n_shards)
+		log_debug("[debug] %s has %d shards, shards=%d is ignored \n",
+		          file_name,
+		          sb->n_shards,
+		          n_shards);
+
+	int started[MAX_SHARDS];
+
+	for (int k = 0; k < sb->n_shards; k++) {
+		started[k] = !pthread_create(&shards[k].thread, NULL, load_shard, &shards[k]);
+		if (!started[k])
+			load_shard(&shards[k]);  // No thread: load it here
+	}
+
+	int ret = 0;
+
+	for (int k = 0; k < sb->n_shards; k++) {
+		if (started[k])
+			pthread_join(shards[k].thread, NULL);
+		if (shards[k].ret < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+// init_cache();
+// Allocates the block cache, or every block when the cache is disabled
+
+void
+init_cache()
+{
+	if (cache_blocks >= N_BLOCKS)
+		cache_blocks = 0;  // Everything fits: no need to tier
+
+	if (!cache_blocks) {
+		block_data = aligned_alloc(BLOCK_DATA_ALIGN, N_BLOCKS * BLOCK_SIZE);
+		memset(block_data, 0, N_BLOCKS * BLOCK_SIZE);
+		return;
+	}
+
+	block_data = NULL;  // No block is resident
+	size_t size = (size_t) cache_blocks * BLOCK_SIZE;
+	size = (size + BLOCK_DATA_ALIGN - 1) / BLOCK_DATA_ALIGN * BLOCK_DATA_ALIGN;
+
+	cache_data = aligned_alloc(BLOCK_DATA_ALIGN, size);
+	cache_block = malloc(cache_blocks * sizeof(int));
+	cache_flags = calloc(cache_blocks, 1);
+	block_slot = malloc(N_BLOCKS * sizeof(int));
+	for (int i = 0; i < cache_blocks; i++)
+		cache_block[i] = -1;
+	for (int i = 0; i < N_BLOCKS; i++)
+		block_slot[i] = -1;
+	cache_hand = 0;
+	cache_last = -1;
+
+	log_debug("[debug] tiered storage: %d of %d blocks cached \n",
+	          cache_blocks,
+	          N_BLOCKS);
+}
+
+void *
+fisopfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	log_debug("[debug] fisopfs_init() \n");
+
+	if (conn) {  // Cut round trips: the kernel batches writes and listings
+		conn->want |= conn->capable &
+		              (FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_READDIRPLUS);
+		if (writeback_cache)
+			conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+		conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;  // Always send attributes
+		conn->max_write = MAX_IO_SIZE;
+		conn->max_readahead = MAX_IO_SIZE;
+	}
+	writeback_cache = conn && (conn->want & FUSE_CAP_WRITEBACK_CACHE);
+
+	sb = calloc(1, sizeof(struct superblock));
+	bitmap_inodes = calloc(1, sizeof(struct bmap_inodes));
+	bitmap_blocks = calloc(1, sizeof(struct bmap_blocks));
+	inodes = calloc(N_INODES, sizeof(struct inode));
+	init_cache();
+	block_fill = calloc(N_BLOCKS, sizeof(int));
+	block_next = calloc(N_BLOCKS, sizeof(int));
+	block_resv = malloc(N_BLOCKS * sizeof(int));
+	for (int i = 0; i < N_BLOCKS; i++)
+		block_resv[i] = -1;  // Reservations are not persisted
+	files = calloc(N_INODES, sizeof(struct file));
+	dirs = calloc(N_INODES, sizeof(struct dirent));
+	names = calloc(1, sizeof(struct name_arena));
+	name_index = calloc(NAME_INDEX_SIZE, sizeof(struct name_ref));
+	snapshots = calloc(N_SNAPSHOTS, sizeof(struct snapshot));
+	tick_clock();
+
+	if (access(file_name, F_OK) == 0) {
+		if (load_file_system() < 0) {
+			log_error("cannot load %s, run fisopfs-tool fsck\n", file_name);
+			exit(1);
+		}
+
+		compact_names();  // Builds the name index
+	} else if (errno != ENOENT || !create) {  // Checked before mounting too,
+		log_error("cannot load %s: %s\n",   // but the image may be gone
+		          file_name,
+		          strerror(errno));
+		exit(1);
+	} else {
+		sb->magic = SUPERBLOCK_MAGIC;
+		sb->n_dirs = 1;  // One dir: root
+		sb->n_files = 0;
+		sb->n_blocks = n_blocks;
+		sb->n_inodes = n_inodes;
+		sb->n_shards = n_shards;
+		fs_dirty = 1;  // A new image is always written
+
+		for (int k = 0; cache_blocks && k < n_shards; k++) {
+			char path[MAX_FILE_NAME_SIZE + 12];
+
+			shard_path(k, path);  // Evicted blocks need a place to go
+			shards[k].image = fopen(path, "w+");
+			if (!shards[k].image) {
+				log_error("cannot create %s\n", path);
+				exit(1);
+			}
+			fseek(shards[k].image, IMAGE_SIZE - 1, SEEK_SET);
+			fputc(0, shards[k].image);
+		}
+
+		struct dirent root;
+
+		int i = init_inode(0, __S_IFDIR | 0775);
+
+		if (i < 0) {
+			log_debug("[debug] error while initializing root dir \n");
+			exit(1);
+		}
+
+		root.name.off = 0;
+		root.name.len = 0;  // The root has no name
+		root.parent = -1;
+		root.d_ino = i;
+		root.level = 1;
+
+		dirs[0] = root;
+
+		if (sb->magic != SUPERBLOCK_MAGIC)
+			exit(1);
+	}
+
+	return NULL;
+}
+
+void *
+save_shard(void *arg)
+{
+	struct shard *shard = arg;
+	int k = shard - shards;
+	unsigned long sum = shard_checksum(k);
+
+	shard->ret = 0;
+	if (shard->synced && sum == shard->sum)
+		return NULL;  // Unchanged since it was loaded or saved
+
+	char path[MAX_FILE_NAME_SIZE + 12];
+	FILE *file = shard->image;
+
+	shard_path(k, path);
+	if (!file)  // Keep the other shards' regions of the file as holes
+		file = fopen(path, "r+");
+	if (!file)
+		file = fopen(path, "w+");
+
+	int err = !file || shard_io(k, file, 1) < 0;
+
+	if (file && cache_blocks)
+		err |= fflush(file) != 0;
+	else if (file)
+		err |= fclose(file) != 0;
+
+	if (err) {
+		log_error("fisopfs: error saving %s: %s\n", path, strerror(errno));
+		shard->ret = -1;
+	} else {
+		shard->sum = sum;
+		shard->synced = 1;
+		shard->ret = 1;
+	}
+
+	return NULL;
+}
+
+// save_file_system();
+// Writes back the shards that changed, in parallel. When tiered, the cached
+// blocks are written back first, each to the shard file it belongs to.
+// return: 0, or -EIO if a block or a shard could not be saved
+
+int
+save_file_system()
+{
+	int err = cache_blocks ? cache_flush() : 0;
+
+	int started[MAX_SHARDS];
+
+	for (int k = 0; k < sb->n_shards; k++) {
+		started[k] = !pthread_create(&shards[k].thread, NULL, save_shard, &shards[k]);
+		if (!started[k])
+			save_shard(&shards[k]);  // No thread: save it here
+	}
+
+	int written = 0;
+
+	for (int k = 0; k < sb->n_shards; k++) {
+		if (started[k])
+			pthread_join(shards[k].thread, NULL);
+		written += shards[k].ret > 0;
+		if (shards[k].ret < 0)
+			err = -EIO;
+	}
+
+	log_debug("[debug] saved %d of %d shards \n", written, sb->n_shards);
+
+	return err;
+}
+
+// print_metadata_stats();
+// Reports how much memory the metadata of each live inode takes: the inode,
+// its bitmap entry, its file or dir entry and its share of the name arena
+
+void
+print_metadata_stats()
+{
+	int n_files = 0, n_dirs = 0;
+
+	for (int i = 0; i < sb->n_files; i++)
+		n_files += files[i].name.len > 0;
+	for (int d = 0; d < sb->n_dirs; d++)
+		n_dirs += d == 0 || dirs[d].name.len > 0;
+
+	long bytes = (long) n_files * sizeof(struct file) +
+	             (long) n_dirs * sizeof(struct dirent) +
+	             (long) (n_files + n_dirs) *
+	                     (sizeof(struct inode) + sizeof(int)) +
+	             names->used;
+
+	printf("[stats] metadata: %d files, %d dirs, %d bytes of names, "
+	       "%ld bytes per inode \n",
+	       n_files,
+	       n_dirs,
+	       names->used,
+	       bytes / (n_files + n_dirs));
+}
+
+void
+fisopfs_destroy(void *a)
+{
+	log_debug("\n[debug] fisopfs_destroy() \n");
+
+	stop_invalidations();
+	commit_write_buffers();
+	flush_times();
+	if (fs_dirty && persist) {
+		if (save_file_system() < 0)
+			log_error("fisopfs: %s was not fully saved\n", file_name);
+	} else
+		log_debug("[debug] %s, %s is left untouched \n",
+		          persist ? "nothing changed" : "nopersist",
+		          file_name);
+
+	if (cache_blocks) {
+		if (print_stats)
+			printf("[stats] block cache: %ld hits, %ld misses, %ld "
+			       "writebacks \n",
+			       cache_hits,
+			       cache_misses,
+			       cache_writebacks);
+		for (int k = 0; k < sb->n_shards; k++)
+			fclose(shards[k].image);
+		free(cache_data);
+		free(cache_block);
+		free(cache_flags);
+		free(block_slot);
+	}
+	if (print_stats)
+		print_metadata_stats();
+	if (trace_file) {
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	free(sb);
+	free(bitmap_inodes);
+	free(bitmap_blocks);
+	free(inodes);
+	free(block_data);
+	free(block_fill);
+	free(block_next);
+	free(block_resv);
+	free(files);
+	free(dirs);
+	free(names);
+	free(name_index);
+	free(snapshots);
+}
+
+// With readdirplus, libfuse still runs a getattr for every entry it is
+// handed, to fill its own node table. Those come in a row for the same dir,
+// so each thread remembers the last parent dir it resolved, which stays
+// valid until a writer moves fs_seq.
+
+#define LOOKUP_PATH_MAX 1024  // longer parents are always walked
+
+_Thread_local struct {
+	unsigned seq;
+	int n_dir;
+	size_t len;
+	char path[LOOKUP_PATH_MAX];
+} last_parent;
+
+// lookup_parent(path, &name, seq);
+// recv: seq of the read section the lookup runs in
+// return: dir path's last component is in, as walk_path
+
+int
+lookup_parent(const char *path, const char **name, unsigned seq)
+{
+	size_t len = strrchr(path, '/') - path;
+
+	if (last_parent.seq == seq && last_parent.len == len &&
+	    memcmp(last_parent.path, path, len) == 0) {
+		*name = path + len + 1;
+		return last_parent.n_dir;
+	}
+
+	int n_dir = walk_path(dirs, sb->n_dirs, path, name);
+
+	// Even a lookup on torn tables can be kept: its seq is never seen again
+	if (n_dir >= 0 && len < LOOKUP_PATH_MAX) {
+		memcpy(last_parent.path, path, len);
+		last_parent.len = len;
+		last_parent.n_dir = n_dir;
+		last_parent.seq = seq;
+	}
+
+	return n_dir;
+}
+
+// read_attr(path, st, seq);
+// Runs inside a seqlock read section: it must only read the tables
+
+int
+read_attr(const char *path, struct stat *st, unsigned seq)
+{
+	if (is_snapshot_path(path))
+		return snapshot_getattr(path, st);
+
+	int i = 0;  // The root dir
+	int d_ino;
+	int is_file = 0;
+
+	if (strcmp(path, "/") != 0) {
+		const char *name;
+		int n_dir = lookup_parent(path, &name, seq);
+
+		if (n_dir < 0)
+			return -ENOENT;
+
+		int len = strlen(name);
+
+		if ((i = find_dir(dirs, sb->n_dirs, n_dir, name, len)) < 0) {
+			i = find_file(files, sb->n_files, n_dir, name, len);
+			is_file = 1;
+		}
+
+		if (i < 0)
+			return -ENOENT;
+	}
+
+	d_ino = is_file ? files[i].d_ino : dirs[i].d_ino;
+
+	if (d_ino < 0 || d_ino >= N_INODES)
+		return -ENOENT;
+
+	fill_stat(&inodes[d_ino], is_file, 0, st);
+	st->st_ino = d_ino;  // Table indexes of files and dirs overlap
+	if (is_file)
+		st->st_size += pending_len[d_ino];  // Buffered data is part of the file
+
+	return 0;
+}
+
+static int
+fisopfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_getattr(%s) \n", path);
+
+	unsigned seq;
+	int ret;
+
+	do {
+		seq = read_begin();
+		ret = read_attr(path, st, seq);
+	} while (read_retry(seq));
+
+	return ret;
+}
+
+// add_entry(listing, name, len);
+// return: where to put the attributes of the new entry, NULL if it was not
+// added
+
+struct stat *
+add_entry(struct dir_listing *listing, const char *name, int len)
+{
+	if (listing->n_entries >= MAX_DIR_ENTRIES || len <= 0 || len > NAME_MAX_LEN)
+		return NULL;
+
+	int n = listing->n_entries++;
+	memcpy(listing->names[n], name, len);
+	listing->names[n][len] = '\0';
+	memset(&listing->attrs[n], 0, sizeof(struct stat));
+
+	return &listing->attrs[n];
+}
+
+// fill_dir(n_dir, snap, listing);
+// Lists the entries of dir n_dir, with the attributes readdirplus returns,
+// using either the live tables (snap is NULL) or the ones frozen in a snapshot
+
+void
+fill_dir(int n_dir, struct snapshot *snap, struct dir_listing *listing)
+{
+	struct file *files_table = snap ? snap->files : files;
+	struct dirent *dirs_table = snap ? snap->dirs : dirs;
+	struct inode *inodes_table = snap ? snap->inodes : inodes;
+	int n_files = snap ? snap->sb.n_files : sb->n_files;
+	int n_dirs = snap ? snap->sb.n_dirs : sb->n_dirs;
+	struct stat *st;
+
+	for (int n_file = 0; n_file < n_files && n_file < N_INODES; n_file++) {  // Fill files
+		struct file *file = &files_table[n_file];
+		int d_ino = file->d_ino;
+
+		if (file->parent != n_dir || !name_ok(file->name) || d_ino < 0 ||
+		    d_ino >= N_INODES)
+			continue;
+
+		if ((st = add_entry(listing, names->data + file->name.off, file->name.len))) {
+			fill_stat(&inodes_table[d_ino], 1, snap != NULL, st);
+			st->st_ino = d_ino;
+			if (!snap)
+				st->st_size += pending_len[d_ino];
+		}
+	}
+
+	for (int d = 1; d < n_dirs && d < N_INODES; d++) {  // Fill dirs
+		struct dirent *child = &dirs_table[d];
+		if (child->parent != n_dir || !name_ok(child->name) ||
+		    child->d_ino < 0 || child->d_ino >= N_INODES)
+			continue;
+
+		if ((st = add_entry(listing, names->data + child->name.off, child->name.len))) {
+			fill_stat(&inodes_table[child->d_ino], 0, snap != NULL, st);
+			st->st_ino = child->d_ino;
+		}
+	}
+}
+
+int
+snapshot_readdir(const char *path, struct dir_listing *listing)
+{
+	struct stat *st;
+
+	if (strcmp(path, "/" SNAPSHOT_DIR) == 0) {
+		for (int i = 0; i < N_SNAPSHOTS; i++) {
+			struct snapshot *snap = &snapshots[i];
+			int d_ino = snap->dirs[0].d_ino;
+
+			if (snap->used && d_ino >= 0 && d_ino < N_INODES &&
+			    (st = add_entry(listing, snap->name, strlen(snap->name))))
+				fill_stat(&snap->inodes[d_ino], 0, 1, st);
 		}
+		return 0;
+	}
+
+	const char *rest;
+	struct snapshot *snap = get_snapshot(path, &rest);
+	struct dirent *dir = snap ? snapshot_get_dir(snap, rest) : NULL;
+
+	if (!dir || dir->d_ino < 0 || dir->d_ino >= N_INODES)
+		return -ENOENT;
+
+	struct inode inode = snap->inodes[dir->d_ino];
+
+	if (!check_read_permissions(&inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	fill_dir(dir - snap->dirs, snap, listing);
+
+	return 0;
+}
+
+// read_dir(path, listing);
+// Runs inside a seqlock read section: it must only read the tables
+
+int
+read_dir(const char *path, struct dir_listing *listing)
+{
+	listing->n_entries = 0;
+
+	if (is_snapshot_path(path))
+		return snapshot_readdir(path, listing);
+
+	int i = get_dir_index(path);
+
+	if (i < 0 || dirs[i].d_ino < 0 || dirs[i].d_ino >= N_INODES)
+		return -ENOENT;
+
+	struct inode inode = inodes[dirs[i].d_ino];
+
+	if (!check_read_permissions(&inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	struct stat *st;
+	if (i == 0 && (st = add_entry(listing, SNAPSHOT_DIR, strlen(SNAPSHOT_DIR))))
+		fill_stat(&inode, 0, 1, st);  // Same owner and times as root
+
+	fill_dir(i, NULL, listing);
+
+	return 0;
+}
+
+// With readdirplus the attributes of every entry go along with the listing,
+// so ls -l needs no getattr round trip per entry
+
+static int
+fisopfs_readdir(const char *path,
+                void *buffer,
+                fuse_fill_dir_t filler,
+                off_t offset,
+                struct fuse_file_info *fi,
+                enum fuse_readdir_flags flags)
+{
+	log_debug("\n[debug] fisopfs_readdir(%s) \n", path);
+
+	struct dir_listing *listing = malloc(sizeof(struct dir_listing));
+	int plus = flags & FUSE_READDIR_PLUS;
+	unsigned seq;
+	int ret;
+
+	if (!listing)
+		return -ENOMEM;
+
+	do {
+		seq = read_begin();
+		ret = read_dir(path, listing);
+	} while (read_retry(seq));
+
+	if (ret == 0) {
+		filler(buffer, ".", NULL, 0, 0);
+		filler(buffer, "..", NULL, 0, 0);
+
+		for (int j = 0; j < listing->n_entries; j++)
+			filler(buffer,
+			       listing->names[j],
+			       plus ? &listing->attrs[j] : NULL,
+			       0,
+			       plus ? FUSE_FILL_DIR_PLUS : 0);
+	}
+
+	free(listing);
+
+	return ret;
+}
+
+/** Similar to create */
+static int
+fisopfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	log_debug("\n[debug] fisopfs_mknod(%s) \n", path);
+
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	if (strlen(strrchr(path, '/') + 1) > NAME_MAX_LEN)
+		return -ENAMETOOLONG;
+
+	if (!is_file(path))
+		return add_file(path, mode);
+
+	log_debug("\n[debug] file %s already exists!\n", path);
+
+	return 1;
+}
+
+/** Create a file */
+static int
+fisopfs_create(const char *path, mode_t mode, struct fuse_file_info *info)
+{
+	log_debug("\n[debug] fisopfs_create(%s) \n", path);
+
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	if (strlen(strrchr(path, '/') + 1) > NAME_MAX_LEN)
+		return -ENAMETOOLONG;
+
+	if (!is_file(path)) {
+		int err = add_file(path, mode);
+		if (err < 0)
+			return err;
+
+		int i = get_file_index(path);
+		info->fh = (uintptr_t) open_write_buffer(files[i].d_ino);
+		return 0;
+	}
+
+	log_debug("\n[debug] file %s already exists! \n", path);
+
+	return 0 - EEXIST;
+}
+
+/** Open a file. Files opened for writing get a write buffer */
+static int
+fisopfs_open(const char *path, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_open(%s) \n", path);
+
+	int writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+
+	if (is_snapshot_path(path))
+		return writing ? -EROFS : 0;
+
+	int i = get_file_index(path);
+
+	if (i < 0)
+		return -ENOENT;
+
+	fi->fh = 0;
+	if (!writing)
+		return 0;
+
+	if (!check_write_permissions(&inodes[files[i].d_ino])) {
+		return PERMISSION_DENIED;
+	}
+
+	// If there is no memory for the buffer, writes just go unbuffered
+	fi->fh = (uintptr_t) open_write_buffer(files[i].d_ino);
+
+	return 0;
+}
+
+/** Read file */
+static int
+fisopfs_read(const char *path,
+             char *buffer,
+             size_t size,
+             off_t offset,
+             struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_read(%s, %ld, %ld) \n", path, size, offset);
+
+	if (is_snapshot_path(path))
+		return snapshot_read(path, buffer, size, offset);
+
+	int i = get_file_index(path);
+
+	if (i < 0) {
+		log_debug("[debug] read failed. does your file exist? \n");
+		return 0;
+	}
+
+	struct file *file = &files[i];
+	struct inode *inode = &inodes[file->d_ino];
+
+	if (!check_read_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	int err = commit_pending(file->d_ino);  // Reads see buffered writes
+	if (err < 0)
+		return err;
+
+	touch_atime(inode);
+
+	return read_content(inode, buffer, size, offset);
+}
+
+/** Write to file */
+static int
+fisopfs_write(const char *path,
+              const char *buffer,
+              size_t size,
+              off_t offset,
+              struct fuse_file_info *info)
+{
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	struct write_buffer *wb = get_write_buffer(info);
+	if (wb) {  // Permissions were checked on open. Buffered appends are
+		int buffered = buffer_write(wb, buffer, size, offset);  // logged
+		if (buffered != 0)                                      // when committed
+			return buffered;
+	}
+
+	log_debug("\n[debug] fisopfs_write(%s) \n", path);
+	log_debug("[debug] writing %ld bytes in %s \n", size, path);
+	log_debug("[debug] offset: %ld \n", offset);
+
+	int i = get_file_index(path);
+
+	if (i < 0) {
+		log_debug("[debug] write failed. does your file exist? \n");
+		return -1;
+	}
+
+	struct file *file = &files[i];
+
+	log_debug("[debug] found %s \n", path);
+	struct inode *inode = &inodes[file->d_ino];
+
+	if (!check_write_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	int err = commit_pending(file->d_ino);
+	if (err < 0)
+		return err;
+
+	int n_blocks = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;  // Reached
+
+	err = unshare_blocks(inode, n_blocks);  // Copy-on-write
+	if (err < 0)
+		return err;
+
+	touch_mtime(inode);
+
+	int written = write_content(inode, buffer, size, offset);
+
+	if (written < 0)
+		return written;
+
+	return (written > 0 || size == 0) ? written : -ENOSPC;
+}
+
+/** Commit buffered writes on every close() of the file */
+static int
+fisopfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_flush(%s) \n", path);
+
+	struct write_buffer *wb = get_write_buffer(fi);
+
+	return wb ? commit_write_buffer(wb) : 0;
+}
+
+static int
+fisopfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_fsync(%s) \n", path);
+
+	if (!datasync)  // Deferred timestamps are synced too
+		flush_times();
+
+	struct write_buffer *wb = get_write_buffer(fi);
+
+	return wb ? commit_write_buffer(wb) : 0;
+}
+
+/** Last close of the file */
+static int
+fisopfs_release(const char *path, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_release(%s) \n", path);
+
+	struct write_buffer *wb = get_write_buffer(fi);
+
+	if (!wb)
+		return 0;
+
+	fi->fh = 0;
+
+	if (wb->d_ino >= 0)  // The file is done growing
+		drop_reservation(wb->d_ino);
+
+	return close_write_buffer(wb);
+}
+
+void
+remove_file(struct file *remove)
+{
+	struct inode *remove_inode = &inodes[remove->d_ino];
+	detach_write_buffers(remove->d_ino);
+	drop_reservation(remove->d_ino);
+	flush_blocks(remove_inode);
+
+	bitmap_inodes->free_inodes[remove->d_ino] = 0;  // Free inode bitmap index
+
+	memset(remove_inode, 0, sizeof(struct inode));
+	memset(remove, 0, sizeof(struct file));
+
+	remove_inode = NULL;
+	remove = NULL;
+}
+
+/** Remove a file */
+static int
+fisopfs_unlink(const char *path)
+{
+	log_debug("\n[debug] fisopfs_unlink(%s) \n", path);
+
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	int i = get_file_index(path);
+	if (i < 0)
+		return -ENOENT;
+
+	struct file *file = &files[i];
+	struct inode *inode = &inodes[dirs[file->parent].d_ino];
+
+	if (!check_write_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	remove_file(file);
 
-		root.d_ino = i;
-		root.parent = -1;
-		strcpy(root.path, "/");
-		root.n_files = 0;
-		root.n_dir = 0;
-		root.level = 1;
+	return 0;
+}
 
-		dirs[0] = root;
+// mkdir /.snapshots/<name> takes a snapshot of the whole filesystem
 
-		if (sb->magic != SUPERBLOCK_MAGIC)
-			exit(1);
+int
+snapshot_mkdir(const char *path)
+{
+	const char *name = snapshot_name(path);
+	const char *rest;
+
+	if (!name)
+		return get_snapshot(path, &rest) ? -EROFS : -EEXIST;
+
+	if (!check_write_permissions(&inodes[dirs[0].d_ino])) {
+		return PERMISSION_DENIED;
 	}
 
-	return NULL;
+	return snapshot_create(name);
 }
 
-void
-save_file_system()
+// rmdir /.snapshots/<name> deletes the snapshot, releasing its blocks
+
+int
+snapshot_rmdir(const char *path)
 {
-	FILE *file = fopen(file_name, "w+");
+	const char *rest;
+	struct snapshot *snap = get_snapshot(path, &rest);
+
+	if (!snap)
+		return -ENOENT;
 
-	// save super block
-	fwrite(sb, sizeof(struct superblock), 1, file);
-	// save bitmap nodes
-	fwrite(bitmap_inodes, sizeof(struct bmap_inodes), 1, file);
-	fwrite(bitmap_blocks, sizeof(struct bmap_blocks), 1, file);
-	fwrite(inodes, sizeof(struct inode), N_INODES, file);
-	fwrite(blocks, sizeof(struct block), N_BLOCKS, file);
-	fwrite(files, sizeof(struct file), N_INODES, file);
-	fwrite(dirs, sizeof(struct dirent), N_INODES, file);
+	if (!snapshot_name(path))
+		return -EROFS;
 
-	fclose(file);
+	if (!check_write_permissions(&inodes[dirs[0].d_ino])) {
+		return PERMISSION_DENIED;
+	}
+
+	snapshot_delete(snap);
+
+	return 0;
 }
 
+/** Create directory */
+static int
+fisopfs_mkdir(const char *path, mode_t mode)
+{
+	log_debug("\n[debug] fisopfs_mkdir(%s, %d) \n", path, mode);
 
-void
-fisopfs_destroy(void *a)
+	if (is_snapshot_path(path))
+		return snapshot_mkdir(path);
+
+	const char *name;
+	int n_parent = walk_path(dirs, sb->n_dirs, path, &name);
+
+	if (n_parent < 0)
+		return -ENOENT;
+
+	if (strlen(name) > NAME_MAX_LEN)
+		return -ENAMETOOLONG;
+
+	struct dirent *parent = &dirs[n_parent];
+	log_debug("[debug] parent level is %d \n", parent->level);
+
+	struct inode *inode = &inodes[parent->d_ino];
+
+	if (!check_write_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	touch_mtime(inode);
+
+	if (parent->level < MAX_DEPTH_DIR && sb->n_dirs < N_INODES) {
+		struct name_ref ref = add_name(name, strlen(name));
+		if (ref.len == 0)
+			return -ENOSPC;
+
+		int i = init_inode(entry_shard(n_parent, ref), __S_IFDIR | 0775);
+		if (i > -1) {
+			struct dirent new_dir;  // Initialize new dir
+			new_dir.name = ref;
+			new_dir.parent = n_parent;
+			new_dir.d_ino = i;
+			new_dir.level = parent->level + 1;
+			dirs[sb->n_dirs++] = new_dir;
+
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/** Remove a directory */
+static int
+fisopfs_rmdir(const char *path)
 {
-	printf("\n[debug] fisopfs_destroy() \n");
+	log_debug("\n[debug] fisopfs_rmdir(%s) \n", path);
 
-	save_file_system();
-	free(sb);
-	free(bitmap_inodes);
-	free(bitmap_blocks);
-	free(inodes);
-	free(blocks);
-	free(files);
-	free(dirs);
+	if (is_snapshot_path(path))
+		return snapshot_rmdir(path);
+
+	int n_dir = get_dir_index(path);
+	if (n_dir == 0)
+		return -EBUSY;  // The root is never removed
+	if (n_dir < 0)
+		return 0;
+
+	struct dirent *dir = &dirs[n_dir];
+	struct dirent *parent = &dirs[dir->parent];
+	struct inode *inode = &inodes[parent->d_ino];
+
+	if (!check_write_permissions(inode))
+		return PERMISSION_DENIED;
+
+	touch_mtime(inode);
+
+	for (int i = 0; i < sb->n_files; i++)
+		if (files[i].name.len && files[i].parent == n_dir)
+			remove_file(&files[i]);  // Remove contained files
+	bitmap_inodes->free_inodes[dir->d_ino] = 0;  // Free inode in bitmap
+	memset(&inodes[dir->d_ino], 0, sizeof(struct inode));
+	memset(dir, 0, sizeof(struct dirent));
+
+	return 0;
 }
 
+/** Update file's times (modification, access) */
 static int
-fisopfs_getattr(const char *path, struct stat *st)
+fisopfs_utimens(const char *path,
+                const struct timespec tv[2],
+                struct fuse_file_info *fi)
 {
-	printf("\n[debug] fisopfs_getattr(%s) \n", path);
+	log_debug("\n[debug] fisopfs_utimens(%s) \n", path);
 
-	ino_t i;
-	struct inode *inode;
+	if (is_snapshot_path(path))
+		return -EROFS;
 
-	if ((strcmp(path, "/") == 0) || is_dir(path)) {
-		i = get_dir_index(path);
-		inode = &inodes[dirs[i].d_ino];
-		st->st_nlink = 3;
+	int i = get_file_index(path);
+	struct inode *inode;
 
-	} else if (is_file(path)) {
-		i = get_file_index(path);
+	if (i >= 0) {
 		inode = &inodes[files[i].d_ino];
-		st->st_nlink = 1;
-		st->st_size = inode->st_size;
+	} else if ((i = get_dir_index(path)) >= 0) {
+		inode = &inodes[dirs[i].d_ino];
 	} else {
 		return -ENOENT;
 	}
 
-	st->st_mode = inode->st_mode;
-	st->st_ino = i;
-	st->st_gid = inode->st_gid;
-	st->st_uid = inode->st_uid;
-	inode->st_atime = time(NULL);
-	st->st_atime = inode->st_atime;
-	st->st_mtime = inode->st_mtime;
-	st->st_ctime = inode->st_ctime;
-	st->st_blocks = inode->st_blocks;
+	if (!check_write_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	if (!tv) {  // utime(path, NULL) sets both times to now
+		inode->st_atime = inode->st_mtime = fs_clock;
+	} else {
+		if (tv[0].tv_nsec != UTIME_OMIT)
+			inode->st_atime =
+			        tv[0].tv_nsec == UTIME_NOW ? fs_clock : tv[0].tv_sec;
+		if (tv[1].tv_nsec != UTIME_OMIT)
+			inode->st_mtime =
+			        tv[1].tv_nsec == UTIME_NOW ? fs_clock : tv[1].tv_sec;
+	}
+
+	touch_ctime(inode);
+	fs_dirty = 1;  // Explicit times are persisted even with lazytime
 
 	return 0;
 }
 
 static int
-fisopfs_readdir(const char *path,
-                void *buffer,
-                fuse_fill_dir_t filler,
-                off_t offset,
-                struct fuse_file_info *fi)
+fisopfs_getxattr(const char *a, const char *b, char *c, size_t s)
 {
-	printf("\n[debug] fisopfs_readdir(%s) \n", path);
+	log_debug("\n[debug] fisopfs_getxattr(%s, %s, %s, %ld) \n", a, b, c, s);
+	return 0;
+}
 
-	filler(buffer, ".", NULL, 0);
-	filler(buffer, "..", NULL, 0);
+/** Set extended attribute. Only used to roll back to a snapshot:
+ * setfattr -n user.fisopfs.rollback <mount>/.snapshots/<name>
+ * Not under the writeback cache: the kernel would keep the sizes and times it
+ * has cached, and flush its dirty pages into the restored files */
+static int
+fisopfs_setxattr(const char *path,
+                 const char *name,
+                 const char *value,
+                 size_t size,
+                 int flags)
+{
+	log_debug("\n[debug] fisopfs_setxattr(%s, %s) \n", path, name);
 
-	struct dirent *dir = NULL;
-	if (strcmp(path, "/") == 0)
-		dir = &dirs[0];
+	if (strcmp(name, SNAPSHOT_ROLLBACK_XATTR) != 0)
+		return -ENOTSUP;
+
+	const char *rest;
+	struct snapshot *snap = get_snapshot(path, &rest);
+
+	if (!snap || !snapshot_name(path))
+		return -EINVAL;
+
+	if (!check_write_permissions(&inodes[dirs[0].d_ino])) {
+		return PERMISSION_DENIED;
+	}
+
+	if (writeback_cache)
+		return -EOPNOTSUPP;
+
+	snapshot_rollback(snap);
+
+	return 0;
+}
+
+static int
+fisopfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_chmod(%s, %d) \n", path, mode);
+
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	struct inode *inode;
+
+	int i = get_file_index(path);
+	if (i < 0) {
+		i = get_dir_index(path);
+		if (i < 0)
+			return -1;
+		inode = &inodes[dirs[i].d_ino];
+	}
 
 	else {
-		dir = &dirs[get_dir_index(path)];
+		inode = &inodes[files[i].d_ino];
 	}
 
-	if (dir != NULL) {
-		if (!check_read_permissions(&inodes[dir->d_ino])) {
-			return PERMISSION_DENIED;
-		}
+	touch_ctime(inode);
+
+	uid_t uid = caller_uid();
+
+	log_debug("[debug] context_uid(%d) - uid(%d) \n", uid, inode->st_uid);
+	if (inode->st_uid == uid)
+		inode->st_mode = mode;
+
+	log_debug("[debug] inode in mode %d \n", inode->st_mode);
+
+	return 0;
+}
+
+static int
+fisopfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_chown(%s, %d, %d) \n", path, uid, gid);
+
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	int i = get_file_index(path);
+	if (i < 0)
+		return -1;
+	struct file *file = &files[i];
+
+	struct inode *inode = &inodes[file->d_ino];
+
+	touch_ctime(inode);
+
+	if (uid != -1) {
+		inode->st_uid = uid;
+	}
+
+	if (gid != -1) {
+		inode->st_gid = gid;
+	}
+
+	return 0;
+}
 
-		for (int j = 0; j < dir->n_files; j++) {  // Fill files
+static int
+fisopfs_truncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_truncate(%s, %ld) \n", path, offset);
 
-			int n_file = dir->files[j];
-			if (n_file == -1)
-				continue;
-			struct file *file = &files[n_file];
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	int i = get_file_index(path);
+	if (i < 0)
+		return -1;
+	struct file *file = &files[i];
 
-			if (file != NULL)
-				filler(buffer, file->filename, NULL, 0);
+	log_debug("[debug] found %s \n", path);
+	struct inode *inode = &inodes[file->d_ino];
+	char *keep = NULL;
+
+	if (offset < 0)
+		return -EINVAL;
+	if (offset > N_BLOCKS_INODE * BLOCK_SIZE)
+		return -EFBIG;
+
+	if (offset > 0) {  // Keep the first offset bytes, zero padded
+		int err = commit_pending(file->d_ino);
+		if (err < 0)
+			return err;
+
+		keep = calloc(1, offset);
+		if (!keep)
+			return -ENOMEM;
+		if (read_content(inode, keep, offset, 0) < 0) {
+			free(keep);
+			return -EIO;
 		}
+	}
+
+	drop_pending(file->d_ino);  // Buffered data is truncated too
+	drop_reservation(file->d_ino);
+	flush_blocks(inode);
+	touch_mtime(inode);
+
+	if (keep) {
+		int written = write_content(inode, keep, offset, 0);
+		free(keep);
+		if (written < 0)
+			return written;
+		if (written < offset)
+			return -ENOSPC;
+	}
+
+	return 0;
+}
+
+/** Preallocate blocks for [offset, offset + len). Unless FALLOC_FL_KEEP_SIZE
+ * is given, the file grows to cover the range, reading back zeros */
+static int
+fisopfs_fallocate(const char *path,
+                  int mode,
+                  off_t offset,
+                  off_t len,
+                  struct fuse_file_info *fi)
+{
+	log_debug("\n[debug] fisopfs_fallocate(%s, %d, %ld, %ld) \n",
+	          path,
+	          mode,
+	          offset,
+	          len);
+
+	if (is_snapshot_path(path))
+		return -EROFS;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+
+	int i = get_file_index(path);
+	if (i < 0)
+		return -ENOENT;
+
+	struct inode *inode = &inodes[files[i].d_ino];
+	off_t end = offset + len;
+
+	if (!check_write_permissions(inode)) {
+		return PERMISSION_DENIED;
+	}
+
+	if (end > N_BLOCKS_INODE * BLOCK_SIZE)
+		return -EFBIG;
+
+	int err = commit_pending(files[i].d_ino);
+	if (err < 0)
+		return err;
+
+	err = unshare_blocks(inode, inode->st_blocks);  // Copy-on-write
+	if (err < 0)
+		return err;
+
+	int n_blocks = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (alloc_blocks(inode, n_blocks) < n_blocks)
+		return -ENOSPC;
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->st_size) {
+		size_t gap = end - inode->st_size;
+		char *zeros = calloc(1, gap);
+		if (!zeros)
+			return -ENOMEM;
+		int written = write_content(inode, zeros, gap, inode->st_size);
+		free(zeros);
+		if (written < 0)
+			return written;
+		touch_mtime(inode);
+	}
+
+	touch_ctime(inode);
+
+	return 0;
+}
+
+// clone_file(path_in, src_off, path_out, dst_off, len, whole);
+// Shares the blocks of path_in with path_out, see clone_range. The source can
+// be a file inside a snapshot. With whole, path_out is emptied first, so it
+// ends up an exact copy of path_in.
+// return: bytes cloned, 0 if nothing was shared, or an error
+
+static off_t
+clone_file(const char *path_in,
+           off_t src_off,
+           const char *path_out,
+           off_t dst_off,
+           size_t len,
+           int whole)
+{
+	struct inode *src;
+	int src_ino = -1;  // Snapshot inodes are never written
+
+	if (is_snapshot_path(path_out))
+		return -EROFS;
+
+	if (is_snapshot_path(path_in)) {
+		const char *rest;
+		struct snapshot *snap = get_snapshot(path_in, &rest);
+		struct file *file = snap ? snapshot_get_file(snap, rest) : NULL;
+
+		if (!file)
+			return -ENOENT;
+		src = &snap->inodes[file->d_ino];
+	} else {
+		int i = get_file_index(path_in);
+
+		if (i < 0)
+			return is_dir(path_in) ? -EISDIR : -ENOENT;
+		src_ino = files[i].d_ino;
+		src = &inodes[src_ino];
+	}
+
+	int o = get_file_index(path_out);
+
+	if (o < 0)
+		return is_dir(path_out) ? -EISDIR : -ENOENT;
+
+	int dst_ino = files[o].d_ino;
+	struct inode *dst = &inodes[dst_ino];
+
+	if (!check_read_permissions(src) || !check_write_permissions(dst)) {
+		return PERMISSION_DENIED;
+	}
+
+	if (dst == src)
+		return 0;
+
+	int err = src_ino >= 0 ? commit_pending(src_ino) : 0;  // Share the
+	if (err == 0)                                         // buffered data
+		err = commit_pending(dst_ino);                // too
+	if (err < 0)
+		return err;
+
+	if (whole) {
+		drop_reservation(dst_ino);
+		flush_blocks(dst);
+		touch_mtime(dst);
+	}
+
+	off_t cloned = clone_range(dst, dst_off, src, src_off, len);
+
+	if (cloned > 0) {
+		drop_reservation(dst_ino);
+		touch_mtime(dst);
+		if (src_ino >= 0)
+			touch_atime(src);
+	}
+
+	return cloned;
+}
+
+/** Copy between two files of the mount (cp). The blocks are shared when the
+ * range allows it, otherwise the data is read and written back */
+static ssize_t
+fisopfs_copy_file_range(const char *path_in,
+                        struct fuse_file_info *fi_in,
+                        off_t offset_in,
+                        const char *path_out,
+                        struct fuse_file_info *fi_out,
+                        off_t offset_out,
+                        size_t size,
+                        int flags)
+{
+	log_debug("\n[debug] fisopfs_copy_file_range(%s, %ld, %s, %ld, %ld) \n",
+	          path_in,
+	          offset_in,
+	          path_out,
+	          offset_out,
+	          size);
+
+	if (flags)
+		return -EINVAL;
+
+	if (offset_in < 0 || offset_out < 0)
+		return -EINVAL;
+
+	if (size == 0)
+		return 0;
+
+	off_t cloned =
+	        clone_file(path_in, offset_in, path_out, offset_out, size, 0);
+
+	if (cloned != 0)
+		return cloned;
+
+	if (size > N_BLOCKS_INODE * BLOCK_SIZE)  // Max file size
+		size = N_BLOCKS_INODE * BLOCK_SIZE;
+
+	char *buffer = malloc(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	int copied = fisopfs_read(path_in, buffer, size, offset_in, fi_in);
+
+	if (copied > 0)
+		copied = fisopfs_write(path_out, buffer, copied, offset_out, fi_out);
+
+	free(buffer);
+
+	return copied;
+}
+
+/** FISOPFS_IOC_CLONE on an open file makes it a copy of another file of the
+ * mount that shares its blocks, as FICLONE does on other filesystems (FUSE
+ * does not pass FICLONE on) */
+static int
+fisopfs_ioctl(const char *path,
+              int cmd,
+              void *arg,
+              struct fuse_file_info *fi,
+              unsigned int flags,
+              void *data)
+{
+	log_debug("\n[debug] fisopfs_ioctl(%s, %x) \n", path, cmd);
+
+	if ((unsigned int) cmd != FISOPFS_IOC_CLONE)
+		return -ENOTTY;
+
+	// The kernel keeps its own size of files in the writeback cache and
+	// would never see the clone's. cp goes through copy_file_range instead
+	if (writeback_cache)
+		return -EOPNOTSUPP;
+
+	struct fisopfs_clone *clone = data;  // Copied in by FUSE
+
+	clone->src[sizeof(clone->src) - 1] = '\0';
 
-		for (int d = 0; d < sb->n_dirs; d++) {  // Fill dirs
-			struct dirent *child = &dirs[d];
-			if (child != NULL && (&dirs[child->parent] == dir))
-				filler(buffer, child->dirname, NULL, 0);
-		}
-	}
+	off_t cloned = clone_file(
+	        clone->src, 0, path, 0, N_BLOCKS_INODE * BLOCK_SIZE, 1);
 
-	return 0;
+	return cloned < 0 ? (int) cloned : 0;
 }
 
-/** Similar to create */
+// Every operation that changes the file system runs as a seqlock writer.
+// read and open are writers too: they update atime and commit write buffers,
+// but only dirty the image when they actually change something
+
 static int
-fisopfs_mknod(const char *path, mode_t mode, dev_t rdev)
+locked_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-	printf("\n[debug] fisopfs_mknod(%s) \n", path);
+	long long start = trace_begin();
 
-	if (!is_file(path) && strlen(path) < FS_FILENAME_LEN) {
-		if (add_file(path, mode))
-			return 0;
+	write_begin();
+	int ret = fisopfs_mknod(path, mode, rdev);
+	write_end(ret >= 0);
+	trace_op(TRACE_MKNOD, start, path, 0, 0, mode, 0, ret);
 
-		else
-			return PERMISSION_DENIED;
-	}
+	return ret;
+}
+
+static int
+locked_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	long long start = trace_begin();
 
-	printf("\n[debug] file %s already exists, or name is too large!\n", path);
+	write_begin();
+	int ret = fisopfs_create(path, mode, fi);
+	write_end(ret >= 0);
+	trace_op(TRACE_CREATE, start, path, 0, 0, mode, trace_fh(fi), ret);
 
-	return 1;
+	return ret;
 }
 
-/** Create a file */
 static int
-fisopfs_create(const char *path, mode_t mode, struct fuse_file_info *info)
+locked_open(const char *path, struct fuse_file_info *fi)
 {
-	printf("\n[debug] fisopfs_create(%s) \n", path);
-
-	if (!is_file(path) && strlen(path) < FS_FILENAME_LEN) {
-		if (add_file(path, mode))
-			return 0;
+	long long start = trace_begin();
+
+	write_begin();
+	int ret = fisopfs_open(path, fi);
+	write_end(0);
+	trace_op(TRACE_OPEN,
+	         start,
+	         path,
+	         0,
+	         0,
+	         fi ? fi->flags : 0,
+	         trace_fh(fi),
+	         ret);
+
+	return ret;
+}
 
-		else
-			return PERMISSION_DENIED;
-	}
+static int
+locked_read(const char *path,
+            char *buffer,
+            size_t size,
+            off_t offset,
+            struct fuse_file_info *fi)
+{
+	long long start = trace_begin();
 
-	printf("\n[debug] file %s already exists, or name is too large! \n", path);
+	write_begin();
+	int ret = fisopfs_read(path, buffer, size, offset, fi);
+	write_end(0);
+	trace_op(TRACE_READ, start, path, offset, size, 0, trace_fh(fi), ret);
 
-	return 0 - EEXIST;
+	return ret;
 }
 
-/** Read file */
 static int
-fisopfs_read(const char *path,
-             char *buffer,
+locked_write(const char *path,
+             const char *buffer,
              size_t size,
              off_t offset,
              struct fuse_file_info *fi)
 {
-	printf("\n[debug] fisopfs_read(%s, %ld, %ld) \n", path, size, offset);
-
-	int i = get_file_index(path);
-
-	if (i < 0) {
-		printf("[debug] read failed. does your file exist? \n");
-		return 0;
-	}
-
-	struct file *file = &files[i];
-	struct inode *inode = &inodes[file->d_ino];
-
-	if (!check_read_permissions(inode)) {
-		return PERMISSION_DENIED;
-	}
+	long long start = trace_begin();
 
-	inode->st_atime = time(NULL);
+	write_begin();
+	int ret = fisopfs_write(path, buffer, size, offset, fi);
+	write_end(ret >= 0);
+	trace_op(TRACE_WRITE, start, path, offset, size, 0, trace_fh(fi), ret);
 
-	char *content;
-	content = calloc(1, BLOCK_SIZE * inode->st_blocks);
-	printf("[debug] reading content from %ld blocks \n", inode->st_blocks);
-	strcpy(content, "");
-	memset(buffer, 0, size);
-	size_t len = 0;
-	int id_block = inode->ref;
-
-	if (id_block >= 0) {
-		for (int j = 0; j < inode->st_blocks;
-		     j++) {  // Iterate through blocks from an inode
-			struct block *block = &blocks[id_block];
-			printf("[debug] reading absolute block "
-			       "%d\n",
-			       id_block);
-			len += BLOCK_SIZE - block->free_space;
-			strncat(content,
-			        block->content,
-			        BLOCK_SIZE - block->free_space);  // Concatenate their content
-
-			id_block = block->ref;
-		}
-
-		printf("[debug] len : %ld \n", len);
+	return ret;
+}
 
-		memcpy(buffer, content,
-		       len);  // Copy the content into buffer
+static int
+locked_flush(const char *path, struct fuse_file_info *fi)
+{
+	long long start = trace_begin();
 
-		free(content);
-	}
+	write_begin();
+	int ret = fisopfs_flush(path, fi);
+	write_end(0);
+	trace_op(TRACE_FLUSH, start, path, 0, 0, 0, trace_fh(fi), ret);
 
-	return (int) size;
+	return ret;
 }
 
-void
-flush_blocks(struct inode *inode)
+static int
+locked_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-	printf("[debug] flushing blocks from inode %p \n", inode);
+	long long start = trace_begin();
 
-	int id_block = inode->ref;
+	write_begin();
+	int ret = fisopfs_fsync(path, datasync, fi);
+	write_end(0);
+	trace_op(TRACE_FSYNC, start, path, 0, 0, datasync, trace_fh(fi), ret);
 
-	for (int j = 0; j < inode->st_blocks; j++) {
-		printf("[debug] cleaning block %d of %ld\n",
-		       j + 1,
-		       inode->st_blocks);
-
-		struct block *clean_block = &blocks[id_block];
-		bitmap_blocks->free_blocks[id_block] =
-		        0;  // Free block bitmap index*/
-		memset(clean_block->content, 0, BLOCK_SIZE);
-		strcpy(clean_block->content, "");  // Clean datablocks
-		clean_block->free_space = BLOCK_SIZE;
-		id_block = clean_block->ref;
-		clean_block->ref = -1;
-	}
-	inode->st_blocks = 0;
-	inode->ref = -1;
-	inode->st_size = 0;
+	return ret;
 }
 
-void
-write_content(struct inode *inode, const char *buffer, size_t size)
+static int
+locked_release(const char *path, struct fuse_file_info *fi)
 {
-	int written = 0;
-	int id_block = inode->ref;
-	struct block *block = NULL;
-	struct block *aux = NULL;
-
-	if (id_block >= 0) {
-		aux = &blocks[id_block];
-	}
+	long long start = trace_begin();
+	unsigned long long fh = trace_fh(fi);  // Cleared by release
 
-	while (written != size) {
-		if (id_block >= 0)
-			block = &blocks[id_block];
+	write_begin();
+	int ret = fisopfs_release(path, fi);
+	write_end(0);
+	trace_op(TRACE_RELEASE, start, path, 0, 0, 0, fh, ret);
 
-		if (!block ||  // If memory needed
-		    block->free_space == 0) {
-			if (inode->st_blocks < N_BLOCKS_INODE) {
-				id_block = init_block();  // Initialize block
+	return ret;
+}
 
-				block = &blocks[id_block];
+static int
+locked_unlink(const char *path)
+{
+	long long start = trace_begin();
 
-				if (aux)
-					aux->ref = id_block;
+	write_begin();
+	int ret = fisopfs_unlink(path);
+	write_end(ret >= 0);
+	trace_op(TRACE_UNLINK, start, path, 0, 0, 0, 0, ret);
 
-				else
-					inode->ref = id_block;
+	return ret;
+}
 
-				aux = block;
-				printf("[debug] Initialize "
-				       "block n: %d \n",
-				       id_block);
+static int
+locked_mkdir(const char *path, mode_t mode)
+{
+	long long start = trace_begin();
 
-				printf("[debug] Inode %p now "
-				       "has %ld blocks "
-				       "assigned\n",
-				       inode,
-				       ++inode->st_blocks);
+	write_begin();
+	int ret = fisopfs_mkdir(path, mode);
+	write_end(ret >= 0);
+	trace_op(TRACE_MKDIR, start, path, 0, 0, mode, 0, ret);
 
-			} else {
-				printf("[debug] Inode %p can't "
-				       "initialize more "
-				       "blocks\n",
-				       inode);
-				break;
-			}
-		}
+	return ret;
+}
 
-		int block_offset = BLOCK_SIZE - block->free_space;
+static int
+locked_rmdir(const char *path)
+{
+	long long start = trace_begin();
 
-		printf("[debug] writing absolute block %d\n", id_block);
+	write_begin();
+	int ret = fisopfs_rmdir(path);
+	write_end(ret >= 0);
+	trace_op(TRACE_RMDIR, start, path, 0, 0, 0, 0, ret);
 
-		if (size > block->free_space) {
-			strncpy(block->content + block_offset,
-			        buffer + written,
-			        block->free_space);
-			written += block->free_space;
-			block->free_space = 0;
-		}
+	return ret;
+}
 
-		else {
-			strncpy(block->content + block_offset,
-			        buffer + written,
-			        size);
-			written += (int) size;
-			block->free_space -= (int) size;
-		}
+static int
+locked_utimens(const char *path,
+               const struct timespec tv[2],
+               struct fuse_file_info *fi)
+{
+	long long start = trace_begin();
 
-		id_block = blocks[id_block].ref;
-	}
+	write_begin();
+	int ret = fisopfs_utimens(path, tv, fi);
+	write_end(ret >= 0);
+	trace_op(TRACE_UTIMENS, start, path, 0, 0, 0, trace_fh(fi), ret);
 
-	inode->st_size += written;
+	return ret;
 }
 
-/** Write to file */
 static int
-fisopfs_write(const char *path,
-              const char *buffer,
-              size_t size,
-              off_t offset,
-              struct fuse_file_info *info)
+locked_setxattr(const char *path,
+                const char *name,
+                const char *value,
+                size_t size,
+                int flags)
 {
-	printf("\n[debug] fisopfs_write(%s) \n", path);
-	printf("[debug] writing %ld bytes in %s \n", size, path);
-	printf("[debug] offset: %ld \n", offset);
-
-	int i = get_file_index(path);
-
-	if (i < 0) {
-		printf("[debug] write failed. does your file exist? \n");
-		return -1;
-	}
+	long long start = trace_begin();
+
+	write_begin();
+	int ret = fisopfs_setxattr(path, name, value, size, flags);
+	write_end(ret >= 0);
+	trace_arg(TRACE_SETXATTR,
+	          start,
+	          path,
+	          name,
+	          strlen(name),
+	          0,
+	          size,
+	          flags,
+	          0,
+	          ret);
+
+	return ret;
+}
 
-	struct file *file = &files[i];
+static int
+locked_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	long long start = trace_begin();
 
-	printf("[debug] found %s \n", file->path);
-	struct inode *inode = &inodes[file->d_ino];
+	write_begin();
+	int ret = fisopfs_chmod(path, mode, fi);
+	write_end(ret >= 0);
+	trace_op(TRACE_CHMOD, start, path, 0, 0, mode, trace_fh(fi), ret);
 
-	if (!check_write_permissions(inode)) {
-		return PERMISSION_DENIED;
-	}
+	return ret;
+}
 
-	inode->st_atime = time(NULL);
-	inode->st_mtime = time(NULL);
+static int
+locked_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+	long long start = trace_begin();
 
-	write_content(inode, buffer, size);
+	write_begin();
+	int ret = fisopfs_chown(path, uid, gid, fi);
+	write_end(ret >= 0);
+	trace_op(TRACE_CHOWN, start, path, 0, gid, uid, trace_fh(fi), ret);
 
-	return (int) size;
+	return ret;
 }
 
-void
-remove_file(struct file *remove)
+static int
+locked_truncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
-	struct inode *remove_inode = &inodes[remove->d_ino];
-	flush_blocks(remove_inode);
-
-	bitmap_inodes->free_inodes[remove->d_ino] = 0;  // Free inode bitmap index
+	long long start = trace_begin();
 
-	memset(remove_inode, 0, sizeof(struct inode));
-	memset(remove, 0, sizeof(struct file));
+	write_begin();
+	int ret = fisopfs_truncate(path, offset, fi);
+	write_end(ret >= 0);
+	trace_op(TRACE_TRUNCATE, start, path, offset, 0, 0, trace_fh(fi), ret);
 
-	remove_inode = NULL;
-	remove = NULL;
+	return ret;
 }
 
-/** Remove a file */
 static int
-fisopfs_unlink(const char *path)
+locked_fallocate(const char *path,
+                 int mode,
+                 off_t offset,
+                 off_t len,
+                 struct fuse_file_info *fi)
 {
-	printf("\n[debug] fisopfs_unlink(%s) \n", path);
-
-	int i = get_file_index(path);
+	long long start = trace_begin();
+
+	write_begin();
+	int ret = fisopfs_fallocate(path, mode, offset, len, fi);
+	write_end(ret >= 0);
+	trace_op(TRACE_FALLOCATE,
+	         start,
+	         path,
+	         offset,
+	         len,
+	         mode,
+	         trace_fh(fi),
+	         ret);
+
+	return ret;
+}
 
-	struct file *file = &files[i];
-	struct dirent *dir = get_dir(path);
-	struct inode *inode = &inodes[dir->d_ino];
+static ssize_t
+locked_copy_file_range(const char *path_in,
+                       struct fuse_file_info *fi_in,
+                       off_t offset_in,
+                       const char *path_out,
+                       struct fuse_file_info *fi_out,
+                       off_t offset_out,
+                       size_t size,
+                       int flags)
+{
+	long long start = trace_begin();
+	size_t max = N_BLOCKS_INODE * BLOCK_SIZE;  // Traced, same copy
+
+	write_begin();
+	ssize_t ret = fisopfs_copy_file_range(path_in,
+	                                      fi_in,
+	                                      offset_in,
+	                                      path_out,
+	                                      fi_out,
+	                                      offset_out,
+	                                      size,
+	                                      flags);
+	write_end(ret > 0);
+	trace_arg(TRACE_COPY_FILE_RANGE,
+	          start,
+	          path_in,
+	          path_out,
+	          strlen(path_out),
+	          offset_in,
+	          size < max ? size : max,
+	          offset_out,
+	          trace_fh(fi_out),
+	          ret);
+
+	return ret;
+}
 
-	if (!check_write_permissions(inode)) {
-		return PERMISSION_DENIED;
+static int
+locked_ioctl(const char *path,
+             int cmd,
+             void *arg,
+             struct fuse_file_info *fi,
+             unsigned int flags,
+             void *data)
+{
+	long long start = trace_begin();
+
+	write_begin();
+	int ret = fisopfs_ioctl(path, cmd, arg, fi, flags, data);
+	write_end(ret >= 0);
+	if (ret == 0)  // Drop the destination's cached pages
+		invalidate_later(path);
+	if ((unsigned int) cmd == FISOPFS_IOC_CLONE) {
+		struct fisopfs_clone *clone = data;
+
+		trace_arg(TRACE_CLONE,
+		          start,
+		          path,
+		          clone->src,
+		          strlen(clone->src),
+		          0,
+		          0,
+		          0,
+		          trace_fh(fi),
+		          ret);
 	}
 
-	for (int j = 0; j < dir->n_files; j++) {
-		if (&files[dir->files[j]] == file) {
-			dir->files[j] = -1;
-		}
-	}
+	return ret;
+}
 
-	remove_file(file);
+// getattr, readdir and getxattr take no lock, they are only wrapped to be
+// traced
 
-	return 0;
+static int
+traced_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	long long start = trace_begin();
+	int ret = fisopfs_getattr(path, st, fi);
+	trace_op(TRACE_GETATTR, start, path, 0, 0, 0, trace_fh(fi), ret);
+
+	return ret;
 }
 
-/** Create directory */
 static int
-fisopfs_mkdir(const char *path, mode_t mode)
+traced_readdir(const char *path,
+               void *buffer,
+               fuse_fill_dir_t filler,
+               off_t offset,
+               struct fuse_file_info *fi,
+               enum fuse_readdir_flags flags)
 {
-	printf("\n[debug] fisopfs_mkdir(%s, %d) \n", path, mode);
-	struct dirent *parent = get_dir(path);
-	printf("\n[debug] parent is: %s \n", parent->path);
-	printf("[debug] parent level is %d \n", parent->level);
-	printf("[debug] path strlen is %ld \n", strlen(path));
+	long long start = trace_begin();
+	int ret = fisopfs_readdir(path, buffer, filler, offset, fi, flags);
+	trace_op(TRACE_READDIR,
+	         start,
+	         path,
+	         offset,
+	         0,
+	         flags,
+	         trace_fh(fi),
+	         ret);
+
+	return ret;
+}
 
-	struct inode *inode = &inodes[parent->d_ino];
+static int
+traced_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	long long start = trace_begin();
+	int ret = fisopfs_getxattr(path, name, value, size);
+	trace_arg(TRACE_GETXATTR,
+	          start,
+	          path,
+	          name,
+	          strlen(name),
+	          0,
+	          size,
+	          0,
+	          0,
+	          ret);
+
+	return ret;
+}
 
-	if (!check_write_permissions(inode)) {
-		return PERMISSION_DENIED;
-	}
+static struct fuse_operations operations = {
+	.getattr = traced_getattr,
+	.readdir = traced_readdir,
+	.open = locked_open,
+	.read = locked_read,
+	.mkdir = locked_mkdir,
+	.unlink = locked_unlink,
+	.rmdir = locked_rmdir,
+	.write = locked_write,
+	.flush = locked_flush,
+	.fsync = locked_fsync,
+	.release = locked_release,
+	.mknod = locked_mknod,
+	.create = locked_create,
+	.utimens = locked_utimens,
+	.init = fisopfs_init,
+	.getxattr = traced_getxattr,
+	.setxattr = locked_setxattr,
+	.chown = locked_chown,
+	.chmod = locked_chmod,
+	.truncate = locked_truncate,
+	.fallocate = locked_fallocate,
+	.copy_file_range = locked_copy_file_range,
+	.ioctl = locked_ioctl,
+	.destroy = fisopfs_destroy,
+};
 
-	inode->st_atime = time(NULL);
-	inode->st_mtime = time(NULL);
+enum {
+	KEY_NOATIME,
+	KEY_RELATIME,
+	KEY_STRICTATIME,
+	KEY_LAZYTIME,
+	KEY_CACHE_BLOCKS,
+	KEY_SHARDS,
+	KEY_IMAGE,
+	KEY_BLOCKS,
+	KEY_INODES,
+	KEY_NOPERSIST,
+	KEY_NOCREATE,
+	KEY_NOWRITEBACK,
+	KEY_LOG,
+	KEY_STATS,
+	KEY_TRACE,
+};
 
-	if (parent->level < MAX_DEPTH_DIR && (strlen(path) < FS_FILENAME_LEN)) {
-		path++;
-		int i = init_inode(__S_IFDIR | 0775);
-		if (i > -1) {
-			struct dirent new_dir;  // Initialize new dir
-			new_dir.n_files = 0;
-			strcpy(new_dir.path, path);
-			strcpy(new_dir.dirname, path + get_name_index(path));
-			new_dir.d_ino = i;
-			new_dir.parent = parent->n_dir;
-			new_dir.level = parent->level + 1;
-			new_dir.n_dir = sb->n_dirs;
-			dirs[sb->n_dirs++] = new_dir;
+static struct fuse_opt fisopfs_opts[] = {
+	FUSE_OPT_KEY("noatime", KEY_NOATIME),
+	FUSE_OPT_KEY("relatime", KEY_RELATIME),
+	FUSE_OPT_KEY("strictatime", KEY_STRICTATIME),
+	FUSE_OPT_KEY("lazytime", KEY_LAZYTIME),
+	FUSE_OPT_KEY("cache_blocks=", KEY_CACHE_BLOCKS),
+	FUSE_OPT_KEY("shards=", KEY_SHARDS),
+	FUSE_OPT_KEY("image=", KEY_IMAGE),
+	FUSE_OPT_KEY("blocks=", KEY_BLOCKS),
+	FUSE_OPT_KEY("inodes=", KEY_INODES),
+	FUSE_OPT_KEY("nopersist", KEY_NOPERSIST),
+	FUSE_OPT_KEY("nocreate", KEY_NOCREATE),
+	FUSE_OPT_KEY("nowriteback", KEY_NOWRITEBACK),
+	FUSE_OPT_KEY("log=", KEY_LOG),
+	FUSE_OPT_KEY("stats", KEY_STATS),
+	FUSE_OPT_KEY("trace=", KEY_TRACE),
+	FUSE_OPT_END,
+};
 
-			return 0;
-		}
-	}
+char trace_name[MAX_FILE_NAME_SIZE];  // Capture file, set by trace=
 
-	return 1;
-}
+// opt_int(arg, min, max, value);
+// Parses the number of a name=N option
+// return: 0, or -1 after reporting it if it is not a number from min to max
 
-/** Remove a directory */
 static int
-fisopfs_rmdir(const char *path)
+opt_int(const char *arg, int min, int max, int *value)
 {
-	printf("\n[debug] fisopfs_rmdir(%s) \n", path);
-	path++;
-	for (int i = 0; i < sb->n_dirs; i++) {
-		struct dirent *dir = &dirs[i];
-		if (strcmp(dir->path, path) == 0) {
-			struct dirent *parent = &dirs[dir->parent];
-			struct inode *inode = &inodes[parent->d_ino];
-
-			if (!check_write_permissions(inode))
-				return PERMISSION_DENIED;
-
-			inode->st_atime = time(NULL);
-			inode->st_mtime = time(NULL);
-
-			for (int j = 0; j < dir->n_files; j++)
-				remove_file(&files[dir->files[j]]);  // Remove contained files
-			bitmap_inodes->free_inodes[dir->d_ino] =
-			        0;  // Free inode in bitmap
-			memset(&inodes[dir->d_ino], 0, sizeof(struct inode));
-			memset(dir, 0, sizeof(struct dirent));
-			dir = NULL;
-		}
+	const char *num = strchr(arg, '=') + 1;
+	char *end;
+	long n = strtol(num, &end, 10);
+
+	if (end == num || *end != '\0' || n < min || n > max) {
+		log_error("fisopfs: %s: must be a number from %d to %d\n",
+		          arg,
+		          min,
+		          max);
+		return -1;
 	}
 
+	*value = n;
 	return 0;
 }
 
-/** Update file's times (modification, access) */
+// The options are handled here and not passed on to fuse: the timestamp
+// modes, since atime is kept by fisopfs and not by the kernel, the image and
+// the geometry and shards of a new one, cache_blocks, which enables tiered
+// storage with a cache of that many blocks, persistence, logging, stats and
+// trace capture
+
 static int
-fisopfs_utimens(const char *path, const struct timespec tv[2])
+fisopfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
 {
-	printf("\n[debug] fisopfs_utimens(%s) \n", path);
+	const char *value = strchr(arg, '=') ? strchr(arg, '=') + 1 : "";
 
-	return 0;
+	switch (key) {
+	case KEY_NOATIME:
+		atime_mode = ATIME_NOATIME;
+		return 0;
+	case KEY_RELATIME:
+		atime_mode = ATIME_RELATIME;
+		return 0;
+	case KEY_STRICTATIME:
+		atime_mode = ATIME_STRICTATIME;
+		return 0;
+	case KEY_LAZYTIME:
+		lazytime = 1;
+		return 0;
+	case KEY_CACHE_BLOCKS:
+		if (opt_int(arg, 0, N_BLOCKS, &cache_blocks) < 0)
+			return -1;
+		if (cache_blocks > 0 && cache_blocks < CACHE_MIN_BLOCKS) {
+			log_error("fisopfs: cache_blocks must be 0 or at least %d\n",
+			          CACHE_MIN_BLOCKS);
+			return -1;
+		}
+		return 0;
+	case KEY_SHARDS:
+		return opt_int(arg, 1, MAX_SHARDS, &n_shards);
+	case KEY_IMAGE:
+		if (value[0] == '\0' || strlen(value) >= MAX_FILE_NAME_SIZE) {
+			log_error("fisopfs: image: %s\n",
+			          strerror(value[0] ? ENAMETOOLONG : EINVAL));
+			return -1;
+		}
+		strcpy(file_name, value);
+		return 0;
+	case KEY_BLOCKS:
+		return opt_int(arg, 1, N_BLOCKS, &n_blocks);
+	case KEY_INODES:
+		return opt_int(arg, 2, N_INODES, &n_inodes);
+	case KEY_NOPERSIST:
+		persist = 0;
+		return 0;
+	case KEY_NOCREATE:
+		create = 0;
+		return 0;
+	case KEY_NOWRITEBACK:
+		writeback_cache = 0;
+		return 0;
+	case KEY_LOG:
+		if (strcmp(value, "error") == 0)
+			log_level = LOG_ERROR;
+		else if (strcmp(value, "info") == 0)
+			log_level = LOG_INFO;
+		else if (strcmp(value, "debug") == 0)
+			log_level = LOG_DEBUG;
+		else {
+			log_error("fisopfs: log must be error, info or debug\n");
+			return -1;
+		}
+		return 0;
+	case KEY_STATS:
+		print_stats = 1;
+		return 0;
+	case KEY_TRACE:
+		if (value[0] == '\0' || strlen(value) >= MAX_FILE_NAME_SIZE) {
+			log_error("fisopfs: trace: %s\n",
+			          strerror(value[0] ? ENAMETOOLONG : EINVAL));
+			return -1;
+		}
+		strcpy(trace_name, value);
+		return 0;
+	default:
+		return 1;
+	}
 }
 
 static int
-fisopfs_getxattr(const char *a, const char *b, char *c, size_t s)
+image_error(const char *path, int err)
 {
-	printf("\n[debug] fisopfs_getxattr(%s, %s, %s, %ld) \n", a, b, c, s);
-	return 0;
+	log_error("fisopfs: %s: %s\n", path, strerror(err));
+	return -err;
 }
 
+// check_image();
+// Makes sure the image can be loaded, or created, before mounting, so that a
+// bad configuration fails right away instead of inside fisopfs_init
+// return: 0, or -errno after reporting it
+
 static int
-fisopfs_chmod(const char *path, mode_t mode)
+check_image()
 {
-	printf("\n[debug] fisopfs_chmod(%s, %d) \n", path, mode);
-	struct inode *inode;
-
-	int i = get_file_index(path);
-	if (i < 0) {
-		i = get_dir_index(path);
-		if (i < 0)
-			return -1;
-		inode = &inodes[dirs[i].d_ino];
+	if (!persist && cache_blocks) {  // Evicted blocks go to the image
+		log_error("fisopfs: nopersist needs cache_blocks=0\n");
+		return -EINVAL;
 	}
 
-	else {
-		inode = &inodes[files[i].d_ino];
+	FILE *file = fopen(file_name, "r");
+
+	if (!file) {
+		if (errno != ENOENT || !create)
+			return image_error(file_name, errno);
+		if (!persist)
+			return 0;  // Starts empty, nothing is written
+
+		char dir[MAX_FILE_NAME_SIZE];
+		char *slash;
+
+		strcpy(dir, file_name);
+		slash = strrchr(dir, '/');
+		if (!slash)
+			strcpy(dir, ".");
+		else if (slash == dir)
+			dir[1] = '\0';  // The root
+		else
+			*slash = '\0';
+
+		return access(dir, W_OK) < 0 ? image_error(dir, errno) : 0;
 	}
 
-	inode->st_atime = time(NULL);
-	inode->st_ctime = time(NULL);
+	struct superblock disk;
+	int ok = fread(&disk, sizeof(struct superblock), 1, file) == 1;
+
+	fclose(file);
+
+	if (!ok || disk.magic != SUPERBLOCK_MAGIC || disk.n_blocks <= 0 ||
+	    disk.n_blocks > N_BLOCKS || disk.n_inodes <= 0 ||
+	    disk.n_inodes > N_INODES || disk.n_shards <= 0 ||
+	    disk.n_shards > MAX_SHARDS) {
+		log_error("fisopfs: %s is not an image this version can mount, "
+		          "run fisopfs-tool fsck\n",
+		          file_name);
+		return -EINVAL;
+	}
 
-	struct fuse_context *context = fuse_get_context();
+	for (int k = 1; k < disk.n_shards; k++) {
+		char path[MAX_FILE_NAME_SIZE + 12];
 
-	printf("[debug] context_uid(%d) - uid(%d) \n", context->uid, inode->st_uid);
-	if (inode->st_uid == context->uid)
-		inode->st_mode = mode;
+		shard_path(k, path);
+		if (access(path, persist ? R_OK | W_OK : R_OK) < 0)
+			return image_error(path, errno);
+	}
 
-	printf("[debug] inode in mode %d \n", inode->st_mode);
+	if (access(file_name, persist ? R_OK | W_OK : R_OK) < 0)
+		return image_error(file_name, errno);
 
 	return 0;
 }
 
+// open_trace();
+// Starts capturing to trace_name, replacing what it had
+// return: 0, or -errno after reporting it
+
 static int
-fisopfs_chown(const char *path, uid_t uid, gid_t gid)
+open_trace()
 {
-	printf("\n[debug] fisopfs_chown(%s, %d, %d) \n", path, uid, gid);
-
-	int i = get_file_index(path);
-	if (i < 0)
-		return -1;
-	struct file *file = &files[i];
+	int magic = TRACE_MAGIC;
 
-	struct inode *inode = &inodes[file->d_ino];
+	trace_file = fopen(trace_name, "wb");
+	if (!trace_file)
+		return image_error(trace_name, errno);
 
-	inode->st_atime = time(NULL);
-	inode->st_ctime = time(NULL);
+	if (fwrite(&magic, sizeof(magic), 1, trace_file) != 1 ||
+	    fflush(trace_file) != 0) {  // Nothing buffered when fuse forks
+		int err = errno;
 
-	if (uid != -1) {
-		inode->st_uid = uid;
+		fclose(trace_file);
+		trace_file = NULL;
+		return image_error(trace_name, err);
 	}
 
-	if (gid != -1) {
-		inode->st_gid = gid;
-	}
+	trace_base = trace_now();
 
 	return 0;
 }
 
+// absolute_image();
+// Without -f fuse daemonizes and changes to / before init, so a relative
+// image path is made absolute while it still names the file check_image saw.
+// The shards and the cache files are named after it.
+// return: 0, or -errno after reporting it
+
 static int
-fisopfs_truncate(const char *path, off_t offset)
+absolute_image()
 {
-	printf("\n[debug] fisopfs_truncate(%s, %ld) \n", path, offset);
+	char cwd[MAX_FILE_NAME_SIZE];
 
-	int i = get_file_index(path);
-	if (i < 0)
-		return -1;
-	struct file *file = &files[i];
+	if (file_name[0] == '/')
+		return 0;
 
-	printf("[debug] found %s \n", path);
-	struct inode *inode = &inodes[file->d_ino];
-	flush_blocks(inode);
+	if (!getcwd(cwd, sizeof(cwd)))
+		return image_error(file_name, errno);
+
+	size_t dir_len = strcmp(cwd, "/") ? strlen(cwd) : 0;
+	size_t len = strlen(file_name);
+
+	if (dir_len + 1 + len >= MAX_FILE_NAME_SIZE)
+		return image_error(file_name, ENAMETOOLONG);
+
+	memmove(file_name + dir_len + 1, file_name, len + 1);
+	memcpy(file_name, cwd, dir_len);
+	file_name[dir_len] = '/';
 
 	return 0;
 }
 
-static struct fuse_operations operations = {
-	.getattr = fisopfs_getattr,
-	.readdir = fisopfs_readdir,
-	.read = fisopfs_read,
-	.mkdir = fisopfs_mkdir,
-	.unlink = fisopfs_unlink,
-	.rmdir = fisopfs_rmdir,
-	.write = fisopfs_write,
-	.mknod = fisopfs_mknod,
-	.create = fisopfs_create,
-	.utimens = fisopfs_utimens,
-	.init = fisopfs_init,
-	.getxattr = fisopfs_getxattr,
-	.chown = fisopfs_chown,
-	.chmod = fisopfs_chmod,
-	.truncate = fisopfs_truncate,
-	.destroy = fisopfs_destroy,
-};
+// fisopfs-replay includes this file to run the same core, with its own main
+#ifndef FISOPFS_NO_MAIN
+
+// Exits with the errno of the first problem found in the options or the
+// image, without mounting
 
 int
 main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &operations, NULL);
-}
\ No newline at end of file
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+	if (fuse_opt_parse(&args, NULL, fisopfs_opts, fisopfs_opt_proc) == -1)
+		return EINVAL;
+
+	int err = absolute_image();
+
+	if (err == 0)
+		err = check_image();
+	if (err == 0 && trace_name[0])
+		err = open_trace();
+
+	if (err < 0) {
+		fuse_opt_free_args(&args);
+		return -err;
+	}
+
+	char max_read[32];  // Only settable as a mount option
+	snprintf(max_read, sizeof(max_read), "-omax_read=%d", MAX_IO_SIZE);
+	fuse_opt_add_arg(&args, max_read);
+
+	in_fuse = 1;
+	int ret = fuse_main(args.argc, args.argv, &operations, NULL);
+
+	fuse_opt_free_args(&args);
+
+	return ret;
+}
+
+#endif
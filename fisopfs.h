@@ -5,51 +5,76 @@
 #ifndef SISOP_2022B_G23_FISOPFS_H
 #define SISOP_2022B_G23_FISOPFS_H
 
-#define FS_FILENAME_LEN 64
+#define FS_FILENAME_LEN 64  // snapshot names
+#define NAME_MAX_LEN 255    // file and dir names, as in Linux
+#define NAME_ARENA_SIZE (N_INODES * 64)  // bytes for all the names
+#define NAME_INDEX_SIZE (N_INODES * 4)   // slots of the in-memory name index
 #define BLOCK_SIZE 256
 #define N_BLOCKS 256
 #define N_INODES 64  // 1 inode : 4 blocks ratio
-#define N_FILES_DIR 16
 #define N_BLOCKS_INODE 16  // files max size = 4096 bytes
-#define SUPERBLOCK_MAGIC 123456
-#define MAX_FILE_NAME_SIZE 50
+#define SUPERBLOCK_MAGIC 123460  // changes with the image layout
+#define MAX_FILE_NAME_SIZE 1024  // image path, set with image=
 #define MAX_DEPTH_DIR 8
 #define PERMISSION_DENIED -13
+#define N_SNAPSHOTS 8
+#define SNAPSHOT_DIR ".snapshots"  // virtual read-only dir at the root
+#define SNAPSHOT_ROLLBACK_XATTR "user.fisopfs.rollback"
+#define BLOCK_DATA_ALIGN 4096  // block data region starts page aligned
+#define RESERVE_BLOCKS 4  // min run of free blocks reserved for a growing file
+#define WRITE_BUFFER_SIZE (BLOCK_SIZE * 4)  // small appends are batched
+#define ATIME_NOATIME 0
+#define ATIME_RELATIME 1  // default, as in Linux
+#define ATIME_STRICTATIME 2
+#define RELATIME_WINDOW (24 * 60 * 60)  // relatime refreshes atime once a day
+#define CACHE_MIN_BLOCKS 2  // copy-on-write uses two blocks at once
+#define CACHE_REF 1         // block cache slot used since the hand passed
+#define CACHE_DIRTY 2       // block cache slot must be written back
+#define MAX_IO_SIZE (128 * 1024)  // max_read and max_write requested from fuse
+#define MAX_SHARDS 8  // image files a mount can be split into
+#define LOG_ERROR 0  // log= mount option levels
+#define LOG_INFO 1
+#define LOG_DEBUG 2  // default: every operation is traced
 
 struct superblock {
     int magic;
     int n_files;
     int n_dirs;
+    int n_blocks;  // geometry chosen by mkfs, up to N_BLOCKS
+    int n_inodes;  // and N_INODES
+    int n_shards;  // image files, 1 to MAX_SHARDS
 };
 
 struct bmap_blocks {
-    int free_blocks[N_BLOCKS];
+    int free_blocks[N_BLOCKS];  // reference count: 0 = free, > 1 = shared (COW)
 };
 
 struct bmap_inodes {
     int free_inodes[N_INODES];
 };
 
-struct block {
-    char content[N_BLOCKS];
-    int free_space;
-    int ref;  // reference to next data block
+// Names are kept once in the name arena, without a terminating NUL, and
+// entries refer to them by offset and length. Equal names share their bytes.
+struct name_ref {
+    int off;
+    int len;  // 0 for a removed entry (and the root dir)
+};
+
+struct name_arena {
+    int used;  // bytes taken, space is only reclaimed by compaction
+    char data[NAME_ARENA_SIZE];
 };
 
 struct file {
-    char path[FS_FILENAME_LEN];
-    char filename[FS_FILENAME_LEN];  // filename used by FUSE filler
-    int d_ino;                       // inode number
+    struct name_ref name;
+    int parent;  // dir the file is in
+    int d_ino;   // inode number
 };
 
 struct dirent {
-    int n_dir;
-    char path[FS_FILENAME_LEN];
-    char dirname[FS_FILENAME_LEN];  // dirname used by FUSE filler
-    int d_ino;                      // inode number
-    int n_files;
-    int files[N_FILES_DIR];
-    int parent;
+    struct name_ref name;
+    int parent;  // -1 for the root
+    int d_ino;   // inode number
     int level;
 };
 
@@ -66,4 +91,113 @@ struct inode {
     time_t st_ctime;     // time of last status change
 };
 
+struct snapshot {
+    int used;
+    char name[FS_FILENAME_LEN];
+    time_t created;
+    struct superblock sb;  // metadata tables frozen at creation time,
+    struct bmap_inodes bitmap_inodes;  // data blocks are shared with the
+    struct inode inodes[N_INODES];     // live filesystem through refcounts
+    struct file files[N_INODES];    // names are in the live name arena
+    struct dirent dirs[N_INODES];
+};
+
+// On-disk image: the tables below in this order, then the block data region,
+// which starts page aligned
+#define OFF_BITMAP_INODES ((long) sizeof(struct superblock))
+#define OFF_BITMAP_BLOCKS (OFF_BITMAP_INODES + (long) sizeof(struct bmap_inodes))
+#define OFF_INODES (OFF_BITMAP_BLOCKS + (long) sizeof(struct bmap_blocks))
+#define OFF_BLOCK_FILL (OFF_INODES + (long) sizeof(struct inode) * N_INODES)
+#define OFF_BLOCK_NEXT (OFF_BLOCK_FILL + (long) sizeof(int) * N_BLOCKS)
+#define OFF_FILES (OFF_BLOCK_NEXT + (long) sizeof(int) * N_BLOCKS)
+#define OFF_DIRS (OFF_FILES + (long) sizeof(struct file) * N_INODES)
+#define OFF_NAMES (OFF_DIRS + (long) sizeof(struct dirent) * N_INODES)
+#define OFF_SNAPSHOTS (OFF_NAMES + (long) sizeof(struct name_arena))
+#define IMAGE_META_SIZE                                                       \
+    (OFF_SNAPSHOTS + (long) sizeof(struct snapshot) * N_SNAPSHOTS)
+#define DATA_OFFSET                                                           \
+    ((IMAGE_META_SIZE + BLOCK_DATA_ALIGN - 1) / BLOCK_DATA_ALIGN *            \
+     BLOCK_DATA_ALIGN)
+#define IMAGE_SIZE (DATA_OFFSET + (long) N_BLOCKS * BLOCK_SIZE)
+
+// A sharded image is split into files <image>, <image>.1, ... each laid out
+// as a whole image. Shard k of n owns the inodes and blocks from
+// SHARD_START(k) up to SHARD_START(k + 1), and only those slices of the
+// tables and the data region are kept in its file; the last shard also owns
+// the slots past the geometry. Shard 0 also holds the superblock, files,
+// dirs, names and snapshots.
+#define SHARD_START(k, n, total, max) ((k) >= (n) ? (max) : (total) * (k) / (n))
+
+// Trace of the FUSE operations, written with the trace= mount option and
+// replayed by fisopfs-replay. The file starts with TRACE_MAGIC, then one
+// record per operation, each followed by path_len bytes of path and arg_len
+// bytes of argument (the xattr name or a second path), without NULs. Data is
+// not recorded.
+#define TRACE_MAGIC 0x46535452
+#define TRACE_MAX_LEN 4096  // bytes of path and argument, longer are dropped
+#define TRACE_GETATTR 1
+#define TRACE_READDIR 2
+#define TRACE_MKNOD 3
+#define TRACE_CREATE 4
+#define TRACE_OPEN 5
+#define TRACE_READ 6
+#define TRACE_WRITE 7
+#define TRACE_FLUSH 8
+#define TRACE_FSYNC 9
+#define TRACE_RELEASE 10
+#define TRACE_UNLINK 11
+#define TRACE_MKDIR 12
+#define TRACE_RMDIR 13
+#define TRACE_UTIMENS 14
+#define TRACE_GETXATTR 15
+#define TRACE_SETXATTR 16
+#define TRACE_CHMOD 17
+#define TRACE_CHOWN 18
+#define TRACE_TRUNCATE 19
+#define TRACE_FALLOCATE 20
+#define TRACE_COPY_FILE_RANGE 21  // fh of the output file
+#define TRACE_CLONE 22  // the path is the destination, the argument the source
+#define TRACE_N_OPS 23
+
+struct trace_record {
+    long long start;           // ns since the capture started
+    long long offset;          // read, write, truncate, fallocate and copy
+    unsigned long long fh;     // file handle used, to pair opens and releases
+    unsigned int latency;      // ns, saturated
+    unsigned int size;         // bytes, or the gid for chown
+    unsigned int flags;        // mode, open or xattr flags, the uid for chown,
+                               // or the output offset for copy_file_range
+    int result;                // returned to the kernel
+    unsigned short op;
+    unsigned short path_len;
+    unsigned short arg_len;
+};
+
+// Clone ioctl, issued on the open destination file, which becomes a copy of
+// the file at src, an abs path inside the mount, sharing its blocks. FUSE
+// only passes on ioctls with the argument size encoded in the number, so the
+// path is sent inline.
+#define FISOPFS_CLONE_PATH_MAX 1024
+struct fisopfs_clone {
+    char src[FISOPFS_CLONE_PATH_MAX];
+};
+#define FISOPFS_IOC_CLONE _IOW('f', 1, struct fisopfs_clone)
+
+// In memory only: one per file opened for writing
+struct write_buffer {
+    int d_ino;     // inode the data belongs to, -1 if detached
+    size_t len;    // bytes waiting to be appended to the file
+    char data[WRITE_BUFFER_SIZE];
+    struct write_buffer *next;
+};
+
+// In memory only: names of a directory's entries, copied out of the tables
+// so they can be handed to the FUSE filler once the copy is known to be good
+#define MAX_DIR_ENTRIES (N_INODES + 1)
+struct dir_listing {
+    int n_entries;
+    char names[MAX_DIR_ENTRIES][NAME_MAX_LEN + 1];
+    struct stat attrs[MAX_DIR_ENTRIES];  // sent along with readdirplus
+};
+
 #endif //SISOP_2022B_G23_FISOPFS_H